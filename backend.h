@@ -0,0 +1,126 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#pragma once
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "elmchan/src/diskio.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024	// the Linux and BSD limit, hidden by strict C11 headers
+#endif
+
+/*
+ * An image backend services the sector I/O behind the RAM_disk_* hooks.
+ * Backends embed this struct as their first member so the hooks can
+ * dispatch through it without knowing how the image is stored.
+ */
+struct disk_backend {
+	const char *name;
+	uint64_t size;		/* image size in bytes */
+	uint32_t sector_size;	/* logical sector size of a block device, 0 for image files */
+	uint32_t block_size;	/* physical or erase block size in bytes, 0 if unknown */
+	int trim_zeroes;	/* trimmed sectors read back as zeros */
+
+	DRESULT (*read)(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count);
+	/* NULL for read-only images, which are then reported write protected */
+	DRESULT (*write)(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count);
+	/* optional: write whole sectors gathered from iov starting at sector */
+	DRESULT (*writev)(struct disk_backend *be, const struct iovec *iov, int iovcnt, LBA_t sector);
+	/* optional: release count sectors from sector, RES_PARERR if the target can not */
+	DRESULT (*trim)(struct disk_backend *be, LBA_t sector, LBA_t count);
+	DRESULT (*sync)(struct disk_backend *be);
+	/* optional: sync, then make everything written durable on the storage */
+	DRESULT (*flush)(struct disk_backend *be);
+	/* write back anything still held and release the backend, even on error */
+	DRESULT (*close)(struct disk_backend *be);
+};
+
+/* fill in size and geometry of an open image file or block device */
+int backend_probe(int fd, const char *path, struct disk_backend *be);
+
+/* release the storage behind a byte range, RES_PARERR if the target can not */
+DRESULT backend_discard(int fd, const struct disk_backend *be, uint64_t offset, uint64_t len);
+
+/* fdatasync fd, or the platform's equivalent */
+DRESULT backend_flush_fd(int fd);
+
+/* make a file created or removed next to path durable in its directory */
+DRESULT backend_sync_dir(const char *path);
+
+/* file_backend_open flags */
+#define FILE_BACKEND_DIRECT	0x1	/* bypass the page cache (O_DIRECT / F_NOCACHE) */
+#define FILE_BACKEND_RDONLY	0x2	/* only read, e.g. the backing file of an overlay */
+
+struct disk_backend *file_backend_open(const char *path, int flags);
+struct disk_backend *mmap_backend_open(const char *path);
+/* NULL if the image is over max_bytes or can not be loaded, use the file then */
+struct disk_backend *memory_backend_open(const char *path, uint64_t max_bytes);
+struct disk_backend *simg_backend_open(const char *path);
+int simg_backend_probe(const char *path);	/* 1 if path is an Android sparse image */
+struct disk_backend *qcow2_backend_open(const char *path, int rdonly);
+int qcow2_backend_probe(const char *path);	/* 1 if path is a qcow2 image */
+struct disk_backend *split_backend_open(const char *path, int flags);	/* file_backend_open flags */
+int split_backend_probe(const char *path);	/* 1 if path is a chunk pattern or manifest */
+struct disk_backend *zstd_backend_open(const char *path);
+int zstd_backend_probe(const char *path);	/* 1 if path is in the zstd seekable format */
+struct disk_backend *uring_backend_open(const char *path, unsigned depth, size_t readahead_bytes);
+
+/*
+ * Filters wrap another backend and take ownership of it. If a filter can
+ * not be set up it returns the backend it was given unchanged.
+ */
+struct disk_backend *readahead_backend_open(struct disk_backend *lower, size_t max_bytes);
+struct disk_backend *coalesce_backend_open(struct disk_backend *lower, size_t max_bytes);
+
+/*
+ * Partition part (1-based, MBR or GPT) of a whole disk image with
+ * sector_size byte sectors. Takes ownership of lower on success, returns
+ * NULL and leaves lower to the caller if there is no such partition.
+ */
+struct disk_backend *partition_backend_open(struct disk_backend *lower, unsigned part, unsigned sector_size);
+
+/*
+ * Keep all writes to base in the delta file at delta_path, created if it
+ * does not exist. Takes ownership of base on success, returns NULL and
+ * leaves base to the caller on error.
+ */
+struct disk_backend *overlay_backend_open(struct disk_backend *base, const char *delta_path);
+
+/* write the sectors held in a delta file to target */
+int overlay_apply(struct disk_backend *target, const char *delta_path);
+
+/*
+ * Transaction mode: keep all writes to image in a journal and write them
+ * into it only when the backend is closed. journal_recover finishes or
+ * rolls back the journal of an interrupted run and must be called first.
+ */
+struct disk_backend *journal_backend_open(struct disk_backend *image, const char *journal_path);
+int journal_recover(struct disk_backend *image, const char *journal_path);
+
+/* copy the whole of be to a new file at path, leaving zero blocks as holes */
+int backend_export(struct disk_backend *be, const char *path);
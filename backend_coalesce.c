@@ -0,0 +1,327 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+
+/*
+ * Write-combining filter. FatFs writes single sectors from sync_window
+ * (once per FAT copy) in between cluster sized data writes. Instead of
+ * passing each one down, written sectors are parked here until CTRL_SYNC
+ * or until the pending set reaches its size limit. They are then sorted
+ * and every run of adjacent sectors goes down as one gathered write.
+ * Rewrites of a pending sector just replace its contents.
+ */
+
+#define WC_NONE		UINT32_MAX
+
+struct wc_order {
+	LBA_t sector;
+	uint32_t slot;
+};
+
+struct coalesce_backend {
+	struct disk_backend be;
+	struct disk_backend *lower;
+	BYTE *blocks;		// max_pending sectors of parked data
+	LBA_t *sectors;		// sector held by each slot
+	uint32_t *hash_next;
+	uint32_t *hash;
+	uint32_t hash_mask;
+	uint32_t max_pending;
+	uint32_t n_pending;
+	struct wc_order *order;	// scratch for sorting at flush time
+	struct iovec *iov;	// scratch for gathered writes
+};
+
+static inline uint32_t
+wc_hash(struct coalesce_backend *wc, LBA_t sector) {
+	return (uint32_t)(((uint64_t)sector * 0x9E3779B97F4A7C15ull) >> 32) & wc->hash_mask;
+}
+
+static inline BYTE *
+wc_block(struct coalesce_backend *wc, uint32_t slot) {
+	return wc->blocks + (size_t)slot * FATBOY_SECTOR_SIZE;
+}
+
+static uint32_t
+wc_lookup(struct coalesce_backend *wc, LBA_t sector) {
+	uint32_t slot = wc->hash[wc_hash(wc, sector)];
+
+	while (slot != WC_NONE && wc->sectors[slot] != sector) {
+		slot = wc->hash_next[slot];
+	}
+	return slot;
+}
+
+static int
+wc_cmp(const void *a, const void *b) {
+	LBA_t sa = ((const struct wc_order *)a)->sector;
+	LBA_t sb = ((const struct wc_order *)b)->sector;
+
+	return (sa > sb) - (sa < sb);
+}
+
+static DRESULT
+wc_write_run(struct coalesce_backend *wc, int iovcnt, LBA_t sector) {
+	struct disk_backend *lower = wc->lower;
+
+	if (lower->writev) {
+		return lower->writev(lower, wc->iov, iovcnt, sector);
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		DRESULT res = lower->write(lower, wc->iov[i].iov_base, sector + i, 1);
+		if (res != RES_OK) {
+			return res;
+		}
+	}
+	return RES_OK;
+}
+
+static DRESULT
+wc_flush(struct coalesce_backend *wc) {
+	DRESULT res = RES_OK;
+	uint32_t i = 0;
+
+	if (wc->n_pending == 0) {
+		return RES_OK;
+	}
+
+	for (uint32_t s = 0; s < wc->n_pending; s++) {
+		wc->order[s].sector = wc->sectors[s];
+		wc->order[s].slot = s;
+	}
+	qsort(wc->order, wc->n_pending, sizeof(*wc->order), wc_cmp);
+
+	while (i < wc->n_pending && res == RES_OK) {
+		LBA_t start = wc->order[i].sector;
+		int run = 0;
+
+		while (i + run < wc->n_pending && run < IOV_MAX
+				&& wc->order[i + run].sector == start + run) {
+			wc->iov[run].iov_base = wc_block(wc, wc->order[i + run].slot);
+			wc->iov[run].iov_len = FATBOY_SECTOR_SIZE;
+			run++;
+		}
+		res = wc_write_run(wc, run, start);
+		i += run;
+	}
+
+	// drop everything, even after an error, so a bad sector is not retried forever
+	memset(wc->hash, 0xFF, (size_t)(wc->hash_mask + 1) * sizeof(*wc->hash));
+	wc->n_pending = 0;
+	return res;
+}
+
+static DRESULT
+wc_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct coalesce_backend *wc = (struct coalesce_backend *)be;
+	DRESULT res;
+
+	res = wc->lower->read(wc->lower, buff, sector, count);
+	if (res != RES_OK || wc->n_pending == 0) {
+		return res;
+	}
+
+	// parked writes are newer than what the lower backend has
+	for (UINT i = 0; i < count; i++) {
+		uint32_t slot = wc_lookup(wc, sector + i);
+		if (slot != WC_NONE) {
+			memcpy(buff + (size_t)i * FATBOY_SECTOR_SIZE, wc_block(wc, slot), FATBOY_SECTOR_SIZE);
+		}
+	}
+	return RES_OK;
+}
+
+static DRESULT
+wc_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct coalesce_backend *wc = (struct coalesce_backend *)be;
+	DRESULT res;
+
+	// big writes are already efficient, pass them on but keep parked copies current
+	if (count >= wc->max_pending / 2) {
+		res = wc->lower->write(wc->lower, buff, sector, count);
+		if (res != RES_OK || wc->n_pending == 0) {
+			return res;
+		}
+		for (UINT i = 0; i < count; i++) {
+			uint32_t slot = wc_lookup(wc, sector + i);
+			if (slot != WC_NONE) {
+				memcpy(wc_block(wc, slot), buff + (size_t)i * FATBOY_SECTOR_SIZE, FATBOY_SECTOR_SIZE);
+			}
+		}
+		return RES_OK;
+	}
+
+	for (UINT i = 0; i < count; i++) {
+		uint32_t slot = wc_lookup(wc, sector + i);
+
+		if (slot == WC_NONE) {
+			if (wc->n_pending == wc->max_pending) {
+				res = wc_flush(wc);
+				if (res != RES_OK) {
+					return res;
+				}
+			}
+			slot = wc->n_pending++;
+			wc->sectors[slot] = sector + i;
+			wc->hash_next[slot] = wc->hash[wc_hash(wc, sector + i)];
+			wc->hash[wc_hash(wc, sector + i)] = slot;
+		}
+		memcpy(wc_block(wc, slot), buff + (size_t)i * FATBOY_SECTOR_SIZE, FATBOY_SECTOR_SIZE);
+	}
+	return RES_OK;
+}
+
+static DRESULT
+wc_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct coalesce_backend *wc = (struct coalesce_backend *)be;
+	uint32_t kept = 0;
+
+	// parked writes to freed sectors never need to reach the image
+	memset(wc->hash, 0xFF, (size_t)(wc->hash_mask + 1) * sizeof(*wc->hash));
+	for (uint32_t slot = 0; slot < wc->n_pending; slot++) {
+		LBA_t s = wc->sectors[slot];
+
+		if (s >= sector && s - sector < count) {
+			continue;
+		}
+		if (kept != slot) {
+			memcpy(wc_block(wc, kept), wc_block(wc, slot), FATBOY_SECTOR_SIZE);
+			wc->sectors[kept] = s;
+		}
+		wc->hash_next[kept] = wc->hash[wc_hash(wc, s)];
+		wc->hash[wc_hash(wc, s)] = kept;
+		kept++;
+	}
+	wc->n_pending = kept;
+
+	if (!wc->lower->trim) {
+		return RES_PARERR;
+	}
+	return wc->lower->trim(wc->lower, sector, count);
+}
+
+static DRESULT
+wc_sync(struct disk_backend *be) {
+	struct coalesce_backend *wc = (struct coalesce_backend *)be;
+	DRESULT res;
+
+	res = wc_flush(wc);
+	if (res != RES_OK) {
+		return res;
+	}
+	return wc->lower->sync(wc->lower);
+}
+
+static DRESULT
+wc_durable(struct disk_backend *be) {
+	struct coalesce_backend *wc = (struct coalesce_backend *)be;
+	DRESULT res;
+
+	res = wc_flush(wc);
+	if (res != RES_OK) {
+		return res;
+	}
+	return wc->lower->flush(wc->lower);
+}
+
+static void
+wc_free(struct coalesce_backend *wc) {
+	free(wc->blocks);
+	free(wc->sectors);
+	free(wc->hash_next);
+	free(wc->hash);
+	free(wc->order);
+	free(wc->iov);
+	free(wc);
+}
+
+static DRESULT
+wc_close(struct disk_backend *be) {
+	struct coalesce_backend *wc = (struct coalesce_backend *)be;
+	DRESULT res = wc_flush(wc);
+
+	// the lower backend is closed either way, parked writes are lost by now
+	if (wc->lower->close(wc->lower) != RES_OK) {
+		res = RES_ERROR;
+	}
+	wc_free(wc);
+	return res;
+}
+
+struct disk_backend *
+coalesce_backend_open(struct disk_backend *lower, size_t max_bytes) {
+	struct coalesce_backend *wc;
+	size_t max_pending = max_bytes / FATBOY_SECTOR_SIZE;
+	uint32_t hash_size = 1;
+
+	if (max_pending < 2) {
+		return lower;
+	}
+	if (max_pending >= WC_NONE) {
+		max_pending = WC_NONE - 1;
+	}
+	while (hash_size < max_pending && hash_size < (1u << 31)) {
+		hash_size <<= 1;
+	}
+
+	wc = calloc(1, sizeof(*wc));
+	if (!wc) {
+		return lower;
+	}
+	wc->max_pending = (uint32_t)max_pending;
+	wc->hash_mask = hash_size - 1;
+	wc->blocks = malloc(max_pending * FATBOY_SECTOR_SIZE);
+	wc->sectors = malloc(max_pending * sizeof(*wc->sectors));
+	wc->hash_next = malloc(max_pending * sizeof(*wc->hash_next));
+	wc->hash = malloc((size_t)hash_size * sizeof(*wc->hash));
+	wc->order = malloc(max_pending * sizeof(*wc->order));
+	wc->iov = malloc(IOV_MAX * sizeof(*wc->iov));
+	if (!wc->blocks || !wc->sectors || !wc->hash_next || !wc->hash || !wc->order || !wc->iov) {
+		wc_free(wc);
+		return lower;
+	}
+	memset(wc->hash, 0xFF, (size_t)hash_size * sizeof(*wc->hash));
+	wc->lower = lower;
+
+	wc->be.name = "coalesce";
+	wc->be.size = lower->size;
+	wc->be.sector_size = lower->sector_size;
+	wc->be.block_size = lower->block_size;
+	wc->be.trim_zeroes = lower->trim_zeroes;
+	wc->be.read = wc_read;
+	wc->be.write = lower->write ? wc_write : NULL;	// read-only stays write protected
+	wc->be.trim = wc_trim;
+	wc->be.sync = wc_sync;
+	wc->be.flush = lower->flush ? wc_durable : NULL;
+	wc->be.close = wc_close;
+	return &wc->be;
+}
@@ -0,0 +1,485 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#define _GNU_SOURCE	// O_DIRECT, sync_file_range
+#include <errno.h>
+#include <fcntl.h>
+#if defined(__linux__) && !defined(O_DIRECT)
+#error "O_DIRECT is not visible, _GNU_SOURCE must come before the first #include"
+#endif
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+#include "stats.h"
+
+/*
+ * Positional I/O on a raw image file descriptor. pread/pwrite carry their
+ * own offset, so there is no shared file position to seek and no stdio
+ * buffer in between, and concurrent callers do not disturb each other.
+ *
+ * In direct mode the image is opened with O_DIRECT so it does not fill the
+ * page cache. Transfers then have to be aligned, so they go through an
+ * aligned bounce buffer, and writes that only cover part of an aligned
+ * block read the rest of the block first. A tail of the image that does
+ * not fill a whole block goes through a second, buffered descriptor.
+ */
+
+#define DIRECT_ALIGN	4096			// safe for 512e and 4Kn storage
+#define DIRECT_MAX	(1024 * 1024)		// largest bounce buffer transfer
+
+struct file_backend {
+	struct disk_backend be;
+	int fd;
+	int direct;
+	int buffered_fd;	// direct mode: for the unaligned tail of the image
+	size_t align;
+	BYTE *bounce;		// direct mode: DIRECT_MAX bytes, aligned
+	BYTE *gather;		// direct mode: writev staging, allocated on first use
+	uint64_t dirty_lo;	// bytes written since the last sync, empty if lo == hi
+	uint64_t dirty_hi;
+	int unflushed;		// written to since the last flush
+};
+
+/* Note a write so sync and flush know what there is to do */
+static void
+file_dirty(struct file_backend *fb, uint64_t offset, uint64_t len) {
+	if (fb->dirty_lo == fb->dirty_hi) {
+		fb->dirty_lo = offset;
+		fb->dirty_hi = offset + len;
+	} else {
+		fb->dirty_lo = offset < fb->dirty_lo ? offset : fb->dirty_lo;
+		fb->dirty_hi = offset + len > fb->dirty_hi ? offset + len : fb->dirty_hi;
+	}
+	fb->unflushed = 1;
+}
+
+/* pread until len bytes arrived; returns bytes read, short only at end of file */
+static ssize_t
+pread_full(int fd, void *buf, size_t len, off_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		io_stats.syscalls++;
+		ssize_t n = pread(fd, (BYTE *)buf + done, len - done, offset + done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t
+pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		io_stats.syscalls++;
+		ssize_t n = pwrite(fd, (const BYTE *)buf + done, len - done, offset + done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/* Direct read of [offset, offset + len) which lies below the unaligned tail */
+static int
+direct_read(struct file_backend *fb, BYTE *buff, size_t len, off_t offset) {
+	size_t mask = fb->align - 1;
+
+	while (len > 0) {
+		off_t lo = offset & ~(off_t)mask;
+		size_t skip = offset - lo;
+		size_t span = (skip + len + mask) & ~mask;
+		size_t n;
+
+		if (span > DIRECT_MAX) {
+			span = DIRECT_MAX;
+		}
+		n = span - skip < len ? span - skip : len;
+
+		if (pread_full(fb->fd, fb->bounce, span, lo) != (ssize_t)span) {
+			return -1;
+		}
+		memcpy(buff, fb->bounce + skip, n);
+		buff += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+direct_write(struct file_backend *fb, const BYTE *buff, size_t len, off_t offset) {
+	size_t mask = fb->align - 1;
+
+	while (len > 0) {
+		off_t lo = offset & ~(off_t)mask;
+		size_t skip = offset - lo;
+		size_t span = (skip + len + mask) & ~mask;
+		size_t n;
+
+		if (span > DIRECT_MAX) {
+			span = DIRECT_MAX;
+		}
+		n = span - skip < len ? span - skip : len;
+
+		// read-modify-write the blocks the request only covers part of
+		if (skip && pread_full(fb->fd, fb->bounce, fb->align, lo) != (ssize_t)fb->align) {
+			return -1;
+		}
+		if ((skip + n) & mask) {
+			size_t last = (skip + n) & ~mask;
+			if ((last || !skip) && pread_full(fb->fd, fb->bounce + last, fb->align, lo + last) != (ssize_t)fb->align) {
+				return -1;
+			}
+		}
+		memcpy(fb->bounce + skip, buff, n);
+		if (pwrite_full(fb->fd, fb->bounce, span, lo) != (ssize_t)span) {
+			return -1;
+		}
+		buff += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+file_transfer(struct file_backend *fb, BYTE *buff, size_t len, off_t offset, int write) {
+	off_t tail;
+	size_t head;
+
+	if (!fb->direct) {
+		ssize_t n = write ? pwrite_full(fb->fd, buff, len, offset) : pread_full(fb->fd, buff, len, offset);
+		return n < 0 ? -1 : (size_t)n == len ? 0 : 1;
+	}
+
+	// split off whatever lies in the last, partial block of the image
+	tail = (off_t)fb->be.size & ~(off_t)(fb->align - 1);
+	head = offset >= tail ? 0 : offset + (off_t)len <= tail ? len : (size_t)(tail - offset);
+	if (head < len) {
+		ssize_t n = write ? pwrite_full(fb->buffered_fd, buff + head, len - head, offset + head)
+			: pread_full(fb->buffered_fd, buff + head, len - head, offset + head);
+		if (n < 0) {
+			return -1;
+		}
+		if ((size_t)n != len - head) {
+			return 1;
+		}
+	}
+	if (head == 0) {
+		return 0;
+	}
+	return write ? direct_write(fb, buff, head, offset) : direct_read(fb, buff, head, offset);
+}
+
+static DRESULT
+file_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct file_backend *fb = (struct file_backend *)be;
+	int ret;
+
+	ret = file_transfer(fb, buff, (size_t)count * FATBOY_SECTOR_SIZE, (off_t)sector * FATBOY_SECTOR_SIZE, 0);
+	if (ret < 0) {
+		printf("Read of %u sectors at %llu failed: %s\n", count, (unsigned long long)sector, strerror(errno));
+		return RES_ERROR;
+	}
+	if (ret > 0) {
+		printf("Short read of %u sectors at %llu\n", count, (unsigned long long)sector);
+		return RES_ERROR;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+file_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct file_backend *fb = (struct file_backend *)be;
+
+	file_dirty(fb, (uint64_t)sector * FATBOY_SECTOR_SIZE, (uint64_t)count * FATBOY_SECTOR_SIZE);
+	if (file_transfer(fb, (BYTE *)buff, (size_t)count * FATBOY_SECTOR_SIZE, (off_t)sector * FATBOY_SECTOR_SIZE, 1) != 0) {
+		printf("Write of %u sectors at %llu failed: %s\n", count, (unsigned long long)sector, strerror(errno));
+		return RES_ERROR;
+	}
+	return RES_OK;
+}
+
+/*
+ * Direct mode can not hand the caller's buffers to the kernel, so gather
+ * runs of the vector into one buffer and write each run in one transfer.
+ */
+static DRESULT
+direct_writev(struct file_backend *fb, const struct iovec *iov, int iovcnt, LBA_t sector) {
+	off_t offset = (off_t)sector * FATBOY_SECTOR_SIZE;
+	int i = 0;
+
+	if (!fb->gather) {
+		fb->gather = malloc(DIRECT_MAX);
+		if (!fb->gather) {
+			return RES_ERROR;
+		}
+	}
+
+	while (i < iovcnt) {
+		const BYTE *run = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		if (len < DIRECT_MAX) {
+			memcpy(fb->gather, run, len);
+			for (i++; i < iovcnt && len + iov[i].iov_len <= DIRECT_MAX; i++) {
+				memcpy(fb->gather + len, iov[i].iov_base, iov[i].iov_len);
+				len += iov[i].iov_len;
+			}
+			run = fb->gather;
+		} else {
+			i++;
+		}
+
+		if (file_transfer(fb, (BYTE *)run, len, offset, 1) != 0) {
+			printf("Write of %zu bytes at sector %llu failed: %s\n", len,
+					(unsigned long long)(offset / FATBOY_SECTOR_SIZE), strerror(errno));
+			return RES_ERROR;
+		}
+		offset += len;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+file_writev(struct disk_backend *be, const struct iovec *iov, int iovcnt, LBA_t sector) {
+	struct file_backend *fb = (struct file_backend *)be;
+	struct iovec local[IOV_MAX];
+	off_t offset = (off_t)sector * FATBOY_SECTOR_SIZE;
+	uint64_t total = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	file_dirty(fb, offset, total);
+	if (fb->direct) {
+		return direct_writev(fb, iov, iovcnt, sector);
+	}
+
+	while (iovcnt > 0) {
+		int n_iov = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		size_t len = 0;
+
+		memcpy(local, iov, n_iov * sizeof(*iov));
+		for (int i = 0; i < n_iov; i++) {
+			len += local[i].iov_len;
+		}
+
+		// pwritev may stop short; skip what it wrote and go again
+		struct iovec *cur = local;
+		int cur_cnt = n_iov;
+		while (len > 0) {
+			io_stats.syscalls++;
+			ssize_t n = pwritev(fb->fd, cur, cur_cnt, offset);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				printf("Write of %zu bytes at sector %llu failed: %s\n", len,
+						(unsigned long long)(offset / FATBOY_SECTOR_SIZE), strerror(errno));
+				return RES_ERROR;
+			}
+			offset += n;
+			len -= n;
+			while (cur_cnt > 0 && (size_t)n >= cur->iov_len) {
+				n -= cur->iov_len;
+				cur++;
+				cur_cnt--;
+			}
+			if (cur_cnt > 0) {
+				cur->iov_base = (BYTE *)cur->iov_base + n;
+				cur->iov_len -= n;
+			}
+		}
+
+		iov += n_iov;
+		iovcnt -= n_iov;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+file_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct file_backend *fb = (struct file_backend *)be;
+
+	fb->unflushed = 1;
+	return backend_discard(fb->fd, be, (uint64_t)sector * FATBOY_SECTOR_SIZE, (uint64_t)count * FATBOY_SECTOR_SIZE);
+}
+
+static DRESULT
+file_sync(struct disk_backend *be) {
+	struct file_backend *fb = (struct file_backend *)be;
+
+	// nothing is buffered in user space, the kernel already has every write.
+	// Start writing the dirty range back so a later flush has less to wait for
+#if defined(SYNC_FILE_RANGE_WRITE)
+	if (fb->dirty_lo != fb->dirty_hi && !fb->direct) {
+		io_stats.syscalls++;
+		sync_file_range(fb->fd, fb->dirty_lo, fb->dirty_hi - fb->dirty_lo, SYNC_FILE_RANGE_WRITE);
+	}
+#endif
+	fb->dirty_lo = fb->dirty_hi = 0;
+	return RES_OK;
+}
+
+static DRESULT
+file_flush(struct disk_backend *be) {
+	struct file_backend *fb = (struct file_backend *)be;
+
+	if (!fb->unflushed) {
+		return RES_OK;
+	}
+	if (fb->buffered_fd >= 0 && backend_flush_fd(fb->buffered_fd) != RES_OK) {
+		return RES_ERROR;
+	}
+	if (backend_flush_fd(fb->fd) != RES_OK) {
+		return RES_ERROR;
+	}
+	fb->dirty_lo = fb->dirty_hi = 0;
+	fb->unflushed = 0;
+	return RES_OK;
+}
+
+static DRESULT
+file_close(struct disk_backend *be) {
+	struct file_backend *fb = (struct file_backend *)be;
+	DRESULT res = RES_OK;
+
+	// NFS and the like report failed writes only here
+	if (close(fb->fd) != 0) {
+		printf("ERROR: closing the image failed: %s\n", strerror(errno));
+		res = RES_ERROR;
+	}
+	if (fb->buffered_fd >= 0) {
+		close(fb->buffered_fd);
+	}
+	free(fb->bounce);
+	free(fb->gather);
+	free(fb);
+	return res;
+}
+
+static int
+file_open_direct(struct file_backend *fb, const char *path, int mode) {
+	void *bounce;
+
+	if (posix_memalign(&bounce, DIRECT_ALIGN, DIRECT_MAX) != 0) {
+		return -1;
+	}
+	fb->bounce = bounce;
+	fb->align = DIRECT_ALIGN;
+
+	fb->buffered_fd = open(path, mode);
+	if (fb->buffered_fd < 0) {
+		return -1;
+	}
+
+#if defined(O_DIRECT)
+	fb->fd = open(path, mode | O_DIRECT);
+#else
+	fb->fd = open(path, mode);
+#if defined(F_NOCACHE)
+	if (fb->fd >= 0 && fcntl(fb->fd, F_NOCACHE, 1) != 0) {
+		close(fb->fd);
+		fb->fd = -1;
+	}
+#endif
+#endif
+	return fb->fd < 0 ? -1 : 0;
+}
+
+struct disk_backend *
+file_backend_open(const char *path, int flags) {
+	struct file_backend *fb;
+	int mode;
+
+	fb = calloc(1, sizeof(*fb));
+	if (!fb) {
+		return NULL;
+	}
+	fb->buffered_fd = -1;
+	mode = flags & FILE_BACKEND_RDONLY ? O_RDONLY : O_RDWR;
+
+	if (flags & FILE_BACKEND_DIRECT) {
+		fb->direct = 1;
+		if (file_open_direct(fb, path, mode) != 0) {
+			if (errno != EINVAL || fb->buffered_fd < 0) {
+				printf("ERROR: could not open image '%s' for direct I/O: %s\n", path, strerror(errno));
+				if (fb->buffered_fd >= 0) {
+					close(fb->buffered_fd);
+				}
+				free(fb->bounce);
+				free(fb);
+				return NULL;
+			}
+			// the file system does not do direct I/O (tmpfs, some FUSE mounts)
+			printf("Direct I/O not supported for '%s', using buffered I/O\n", path);
+			fb->direct = 0;
+			fb->fd = fb->buffered_fd;
+			fb->buffered_fd = -1;
+		}
+	} else {
+		fb->fd = open(path, mode);
+		if (fb->fd < 0) {
+			printf("ERROR: could not open image '%s': %s\n", path, strerror(errno));
+			free(fb);
+			return NULL;
+		}
+	}
+
+	if (backend_probe(fb->fd, path, &fb->be) != 0) {
+		file_close(&fb->be);
+		return NULL;
+	}
+
+	fb->be.name = "file";
+	fb->be.read = file_read;
+	fb->be.write = file_write;
+	fb->be.writev = file_writev;
+	fb->be.trim = file_trim;
+	fb->be.sync = file_sync;
+	fb->be.flush = file_flush;
+	fb->be.close = file_close;
+	return &fb->be;
+}
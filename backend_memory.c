@@ -0,0 +1,321 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#define _GNU_SOURCE	// SEEK_DATA, SEEK_HOLE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+#include "stats.h"
+
+// unit of dirty tracking and of the write-back
+#define MEM_CHUNK (64 * 1024)
+
+/*
+ * Holds the whole image in anonymous memory. Only the parts of the file
+ * that hold data are read in, so a freshly created sparse image starts
+ * out as an empty buffer. Writes and syncs never touch the file; the
+ * chunks written to are copied out once when the image is closed, with
+ * chunks that ended up all zeros punched as holes to keep the file sparse.
+ */
+struct mem_backend {
+	struct disk_backend be;
+	int fd;
+	BYTE *mem;
+	size_t len;
+	BYTE *dirty;		/* one flag per MEM_CHUNK */
+	size_t chunks;
+	int punch;		/* the file reads holes back as zeros */
+};
+
+static int
+mem_in_range(struct mem_backend *mb, LBA_t sector, uint64_t count) {
+	uint64_t end = ((uint64_t)sector + count) * FATBOY_SECTOR_SIZE;
+
+	return end <= mb->len;
+}
+
+static void
+mem_mark(struct mem_backend *mb, size_t lo, size_t hi) {
+	size_t c;
+
+	for (c = lo / MEM_CHUNK; c < (hi + MEM_CHUNK - 1) / MEM_CHUNK; c++) {
+		mb->dirty[c] = 1;
+	}
+}
+
+static int
+mem_is_zero(const BYTE *buf, size_t len) {
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+static DRESULT
+mem_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct mem_backend *mb = (struct mem_backend *)be;
+
+	if (!mem_in_range(mb, sector, count)) {
+		printf("Read of %u sectors at %llu is past the end of the image\n", count, (unsigned long long)sector);
+		return RES_ERROR;
+	}
+	memcpy(buff, mb->mem + (size_t)sector * FATBOY_SECTOR_SIZE, (size_t)count * FATBOY_SECTOR_SIZE);
+	return RES_OK;
+}
+
+static DRESULT
+mem_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct mem_backend *mb = (struct mem_backend *)be;
+	size_t lo = (size_t)sector * FATBOY_SECTOR_SIZE;
+	size_t len = (size_t)count * FATBOY_SECTOR_SIZE;
+
+	if (!mem_in_range(mb, sector, count)) {
+		printf("Write of %u sectors at %llu is past the end of the image\n", count, (unsigned long long)sector);
+		return RES_ERROR;
+	}
+	memcpy(mb->mem + lo, buff, len);
+	mem_mark(mb, lo, lo + len);
+	return RES_OK;
+}
+
+static DRESULT
+mem_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct mem_backend *mb = (struct mem_backend *)be;
+	size_t lo = (size_t)sector * FATBOY_SECTOR_SIZE;
+	size_t len = (size_t)count * FATBOY_SECTOR_SIZE;
+
+	if (!mem_in_range(mb, sector, count)) {
+		return RES_PARERR;
+	}
+	// the zeros become holes when the chunks are written back
+	memset(mb->mem + lo, 0, len);
+	mem_mark(mb, lo, lo + len);
+	return RES_OK;
+}
+
+static DRESULT
+mem_pwrite(struct mem_backend *mb, size_t off, size_t len) {
+	while (len > 0) {
+		io_stats.syscalls++;
+		ssize_t n = pwrite(mb->fd, mb->mem + off, len, (off_t)off);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			printf("ERROR: write-back of %zu bytes at %zu failed: %s\n", len, off, n < 0 ? strerror(errno) : "short write");
+			return RES_ERROR;
+		}
+		off += (size_t)n;
+		len -= (size_t)n;
+	}
+	return RES_OK;
+}
+
+// write out runs of dirty chunks, holes for the all-zero ones
+static DRESULT
+mem_writeback(struct mem_backend *mb) {
+	size_t c = 0;
+
+	while (c < mb->chunks) {
+		size_t first, off, end;
+		int zero;
+		DRESULT res;
+
+		if (!mb->dirty[c]) {
+			c++;
+			continue;
+		}
+		first = c;
+		off = first * MEM_CHUNK;
+		zero = mb->punch && mem_is_zero(mb->mem + off, (c + 1) * MEM_CHUNK > mb->len ? mb->len - off : MEM_CHUNK);
+		for (c++; c < mb->chunks && mb->dirty[c]; c++) {
+			size_t coff = c * MEM_CHUNK;
+			size_t clen = coff + MEM_CHUNK > mb->len ? mb->len - coff : MEM_CHUNK;
+
+			if ((mb->punch && mem_is_zero(mb->mem + coff, clen)) != zero) {
+				break;
+			}
+		}
+		end = c * MEM_CHUNK > mb->len ? mb->len : c * MEM_CHUNK;
+
+		res = zero ? backend_discard(mb->fd, &mb->be, off, end - off) : RES_PARERR;
+		if (res == RES_PARERR) {
+			res = mem_pwrite(mb, off, end - off);
+		}
+		if (res != RES_OK) {
+			return res;
+		}
+		memset(mb->dirty + first, 0, c - first);
+	}
+	return RES_OK;
+}
+
+static DRESULT
+mem_sync(struct disk_backend *be) {
+	// nothing reaches the file before it is flushed or closed
+	return RES_OK;
+}
+
+static DRESULT
+mem_flush(struct disk_backend *be) {
+	struct mem_backend *mb = (struct mem_backend *)be;
+	DRESULT res = mem_writeback(mb);
+
+	return res == RES_OK ? backend_flush_fd(mb->fd) : res;
+}
+
+static DRESULT
+mem_close(struct disk_backend *be) {
+	struct mem_backend *mb = (struct mem_backend *)be;
+	DRESULT res;
+
+	// every change of the run reaches the file here, a failure loses them
+	res = mem_writeback(mb);
+
+	if (close(mb->fd) != 0 && res == RES_OK) {
+		printf("ERROR: closing the image failed: %s\n", strerror(errno));
+		res = RES_ERROR;
+	}
+	munmap(mb->mem, mb->len);
+	free(mb->dirty);
+	free(mb);
+	return res;
+}
+
+// read the parts of the file that hold data, holes are already zeros
+static int
+mem_load(struct mem_backend *mb, const char *path) {
+	off_t pos = 0;
+
+	while ((size_t)pos < mb->len) {
+		off_t end = (off_t)mb->len;
+#ifdef SEEK_DATA
+		if (!mb->be.sector_size) {
+			off_t data = lseek(mb->fd, pos, SEEK_DATA);
+
+			if (data < 0 && errno == ENXIO) {
+				break;
+			}
+			if (data >= 0) {
+				pos = data;
+				end = lseek(mb->fd, pos, SEEK_HOLE);
+				if (end < 0 || end > (off_t)mb->len) {
+					end = (off_t)mb->len;
+				}
+			}
+		}
+#endif
+		while (pos < end) {
+			io_stats.syscalls++;
+			ssize_t n = pread(mb->fd, mb->mem + pos, (size_t)(end - pos), pos);
+
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0) {
+				printf("ERROR: could not read image '%s': %s\n", path, strerror(errno));
+				return -1;
+			}
+			if (n == 0) {
+				return 0;
+			}
+			pos += n;
+		}
+	}
+	return 0;
+}
+
+struct disk_backend *
+memory_backend_open(const char *path, uint64_t max_bytes) {
+	struct mem_backend *mb;
+
+	mb = calloc(1, sizeof(*mb));
+	if (!mb) {
+		return NULL;
+	}
+
+	// the caller falls back to the file backend, which reports open errors
+	mb->fd = open(path, O_RDWR);
+	if (mb->fd < 0) {
+		free(mb);
+		return NULL;
+	}
+
+	if (backend_probe(mb->fd, path, &mb->be) != 0) {
+		close(mb->fd);
+		free(mb);
+		return NULL;
+	}
+	if (mb->be.size == 0) {
+		// nothing to load, the image is used in place
+		close(mb->fd);
+		free(mb);
+		return NULL;
+	}
+	if (mb->be.size > max_bytes || mb->be.size > SIZE_MAX) {
+		printf("Image '%s' is larger than the %llu MiB memory limit, using it in place\n", path,
+				(unsigned long long)(max_bytes / (1024 * 1024)));
+		close(mb->fd);
+		free(mb);
+		return NULL;
+	}
+	mb->len = (size_t)mb->be.size;
+	mb->punch = mb->be.trim_zeroes;
+	mb->chunks = (mb->len + MEM_CHUNK - 1) / MEM_CHUNK;
+
+	mb->dirty = calloc(mb->chunks, 1);
+	mb->mem = mmap(NULL, mb->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!mb->dirty || mb->mem == MAP_FAILED) {
+		printf("Not enough memory to hold image '%s', using it in place\n", path);
+		if (mb->mem != MAP_FAILED) {
+			munmap(mb->mem, mb->len);
+		}
+		free(mb->dirty);
+		close(mb->fd);
+		free(mb);
+		return NULL;
+	}
+	if (mem_load(mb, path) != 0) {
+		munmap(mb->mem, mb->len);
+		free(mb->dirty);
+		close(mb->fd);
+		free(mb);
+		return NULL;
+	}
+
+	mb->be.name = "memory";
+	mb->be.trim_zeroes = 1;
+	mb->be.read = mem_read;
+	mb->be.write = mem_write;
+	mb->be.trim = mem_trim;
+	mb->be.sync = mem_sync;
+	mb->be.flush = mem_flush;
+	mb->be.close = mem_close;
+	return &mb->be;
+}
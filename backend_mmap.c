@@ -0,0 +1,192 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+#include "stats.h"
+
+/*
+ * Maps the whole image so sector reads and writes are plain copies.
+ * Writes only dirty the mapping; the range touched since the last flush
+ * is tracked so it can be msynced alone. A sync only starts write-back
+ * (MS_ASYNC), a flush waits for the storage (MS_SYNC).
+ */
+struct mmap_backend {
+	struct disk_backend be;
+	int fd;
+	BYTE *map;
+	size_t map_len;
+	size_t dirty_lo;
+	size_t dirty_hi;	/* dirty_lo == dirty_hi: nothing dirty */
+};
+
+static int
+mmap_in_range(struct mmap_backend *mb, LBA_t sector, UINT count) {
+	uint64_t end = ((uint64_t)sector + count) * FATBOY_SECTOR_SIZE;
+
+	return end <= mb->map_len;
+}
+
+static DRESULT
+mmap_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct mmap_backend *mb = (struct mmap_backend *)be;
+
+	if (!mmap_in_range(mb, sector, count)) {
+		printf("Read of %u sectors at %llu is past the end of the image\n", count, (unsigned long long)sector);
+		return RES_ERROR;
+	}
+	memcpy(buff, mb->map + (size_t)sector * FATBOY_SECTOR_SIZE, (size_t)count * FATBOY_SECTOR_SIZE);
+	return RES_OK;
+}
+
+static DRESULT
+mmap_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct mmap_backend *mb = (struct mmap_backend *)be;
+	size_t lo = (size_t)sector * FATBOY_SECTOR_SIZE;
+	size_t hi = lo + (size_t)count * FATBOY_SECTOR_SIZE;
+
+	if (!mmap_in_range(mb, sector, count)) {
+		printf("Write of %u sectors at %llu is past the end of the image\n", count, (unsigned long long)sector);
+		return RES_ERROR;
+	}
+	memcpy(mb->map + lo, buff, hi - lo);
+
+	if (mb->dirty_lo == mb->dirty_hi) {
+		mb->dirty_lo = lo;
+		mb->dirty_hi = hi;
+	} else {
+		if (lo < mb->dirty_lo) mb->dirty_lo = lo;
+		if (hi > mb->dirty_hi) mb->dirty_hi = hi;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+mmap_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct mmap_backend *mb = (struct mmap_backend *)be;
+
+	// punching the file also drops the mapped pages, they read back as zeros
+	return backend_discard(mb->fd, be, (uint64_t)sector * FATBOY_SECTOR_SIZE, (uint64_t)count * FATBOY_SECTOR_SIZE);
+}
+
+/* msync the pages written since the last flush, waiting for the storage with MS_SYNC */
+static DRESULT
+mmap_msync(struct mmap_backend *mb, int flags) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t lo, hi;
+
+	if (mb->dirty_lo == mb->dirty_hi) {
+		return RES_OK;
+	}
+
+	// msync wants a page aligned start address
+	lo = mb->dirty_lo & ~(page - 1);
+	hi = mb->dirty_hi;
+	io_stats.syscalls++;
+	if (msync(mb->map + lo, hi - lo, flags) != 0) {
+		printf("ERROR: msync of image failed: %s\n", strerror(errno));
+		return RES_ERROR;
+	}
+	// the range stays dirty until it is known to be on the storage
+	if (flags & MS_SYNC) {
+		mb->dirty_lo = mb->dirty_hi = 0;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+mmap_sync(struct disk_backend *be) {
+	return mmap_msync((struct mmap_backend *)be, MS_ASYNC);
+}
+
+static DRESULT
+mmap_flush(struct disk_backend *be) {
+	return mmap_msync((struct mmap_backend *)be, MS_SYNC);
+}
+
+static DRESULT
+mmap_close(struct disk_backend *be) {
+	struct mmap_backend *mb = (struct mmap_backend *)be;
+	DRESULT res = mmap_flush(be);
+
+	munmap(mb->map, mb->map_len);
+	close(mb->fd);
+	free(mb);
+	return res;
+}
+
+struct disk_backend *
+mmap_backend_open(const char *path) {
+	struct mmap_backend *mb;
+
+	mb = calloc(1, sizeof(*mb));
+	if (!mb) {
+		return NULL;
+	}
+
+	mb->fd = open(path, O_RDWR);
+	if (mb->fd < 0) {
+		printf("ERROR: could not open image '%s': %s\n", path, strerror(errno));
+		free(mb);
+		return NULL;
+	}
+
+	if (backend_probe(mb->fd, path, &mb->be) != 0) {
+		close(mb->fd);
+		free(mb);
+		return NULL;
+	}
+	if (mb->be.size == 0 || mb->be.size > SIZE_MAX) {
+		printf("ERROR: image '%s' can not be mapped\n", path);
+		close(mb->fd);
+		free(mb);
+		return NULL;
+	}
+	mb->map_len = (size_t)mb->be.size;
+
+	mb->map = mmap(NULL, mb->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, mb->fd, 0);
+	if (mb->map == MAP_FAILED) {
+		printf("ERROR: mmap of image '%s' failed: %s\n", path, strerror(errno));
+		close(mb->fd);
+		free(mb);
+		return NULL;
+	}
+
+	mb->be.name = "mmap";
+	mb->be.read = mmap_read;
+	mb->be.write = mmap_write;
+	mb->be.trim = mmap_trim;
+	mb->be.sync = mmap_sync;
+	mb->be.flush = mmap_flush;
+	mb->be.close = mmap_close;
+	return &mb->be;
+}
@@ -0,0 +1,758 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+#include "stats.h"
+
+/*
+ * Copy-on-write overlay: the base image is only read, every sector written
+ * goes to a delta file. The delta is a header followed by records of a run
+ * of sectors each:
+ *
+ *	header:	"FBDELTA1", base image size (le64), base fingerprint (le64)
+ *	record:	OVERLAY_REC_MAGIC (le32), sector count (le32), first sector (le64), data
+ *
+ * Sectors are in 512 byte backend units. A sector written again is updated
+ * where it already is in the delta, new sectors are appended as a record.
+ * At open the records are scanned into a hash index of sector to delta
+ * offset; a record cut short by a crash is dropped. The fingerprint is a
+ * hash of the start of the base, which holds the partition table, boot
+ * sector and volume serial, so a delta is not used with the wrong image.
+ *
+ * The same file format serves as the journal of a transaction. All writes
+ * of a run go to <image>.journal while the image is left alone. At close a
+ * commit record (OVERLAY_COMMIT_MAGIC, 0, 0) is appended and flushed, and
+ * only then are the records copied into the image, which is flushed before
+ * the journal is removed. A journal found when an image is opened was cut
+ * short: with a commit record it is replayed, without one it is discarded
+ * and the image is exactly as it was before the interrupted run.
+ */
+
+#define OVERLAY_MAGIC		"FBDELTA1"
+#define OVERLAY_HDR_SZ		24
+#define OVERLAY_PRINT_SZ	(64 << 10)	// bytes of the base that are fingerprinted
+#define OVERLAY_REC_MAGIC	0x52444246	// "FBDR"
+#define OVERLAY_COMMIT_MAGIC	0x43444246	// "FBDC"
+#define OVERLAY_REC_SZ		16
+#define OVERLAY_MAX_RUN		256		// sectors per appended record
+
+struct overlay_backend {
+	struct disk_backend be;
+	struct disk_backend *base;
+	int fd;
+	uint64_t *keys;		// sector + 1, 0 for an empty slot
+	uint64_t *offsets;	// of the sector data in the delta
+	size_t slots;		// power of 2
+	size_t used;
+	uint64_t end;		// where the next record goes
+	BYTE *stage;		// record being appended
+	char *journal;		// path of the journal in transaction mode, else NULL
+	int failed;		// a write was lost, the journal must not be committed
+};
+
+static void
+put_le32(BYTE *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void
+put_le64(BYTE *p, uint64_t v) {
+	put_le32(p, v);
+	put_le32(p + 4, v >> 32);
+}
+
+static uint32_t
+le32(const BYTE *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+le64(const BYTE *p) {
+	return le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+static size_t
+overlay_hash(uint64_t sector, size_t slots) {
+	return (size_t)(sector * 0x9E3779B97F4A7C15ULL >> 17) & (slots - 1);
+}
+
+/* Delta offset of sector, 0 if it has not been written */
+static uint64_t
+overlay_lookup(const struct overlay_backend *ob, uint64_t sector) {
+	if (!ob->used) {
+		return 0;
+	}
+	for (size_t i = overlay_hash(sector, ob->slots); ob->keys[i]; i = (i + 1) & (ob->slots - 1)) {
+		if (ob->keys[i] == sector + 1) {
+			return ob->offsets[i];
+		}
+	}
+	return 0;
+}
+
+static int
+overlay_insert(struct overlay_backend *ob, uint64_t sector, uint64_t offset) {
+	size_t i;
+
+	if ((ob->used + 1) * 4 > ob->slots * 3) {
+		size_t slots = ob->slots ? ob->slots * 2 : 4096;
+		uint64_t *keys = calloc(slots, sizeof(*keys));
+		uint64_t *offsets = calloc(slots, sizeof(*offsets));
+
+		if (!keys || !offsets) {
+			free(keys);
+			free(offsets);
+			printf("ERROR: out of memory for the overlay index\n");
+			return -1;
+		}
+		for (size_t j = 0; j < ob->slots; j++) {
+			if (ob->keys[j]) {
+				for (i = overlay_hash(ob->keys[j] - 1, slots); keys[i]; i = (i + 1) & (slots - 1));
+				keys[i] = ob->keys[j];
+				offsets[i] = ob->offsets[j];
+			}
+		}
+		free(ob->keys);
+		free(ob->offsets);
+		ob->keys = keys;
+		ob->offsets = offsets;
+		ob->slots = slots;
+	}
+	for (i = overlay_hash(sector, ob->slots); ob->keys[i] && ob->keys[i] != sector + 1; i = (i + 1) & (ob->slots - 1));
+	if (!ob->keys[i]) {
+		ob->used++;
+	}
+	ob->keys[i] = sector + 1;
+	ob->offsets[i] = offset;
+	return 0;
+}
+
+static int
+overlay_pread(int fd, void *buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		io_stats.syscalls++;
+		ssize_t n = pread(fd, (BYTE *)buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int
+overlay_pwrite(int fd, const void *buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		io_stats.syscalls++;
+		ssize_t n = pwrite(fd, (const BYTE *)buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			printf("Overlay write of %zu bytes at %llu failed: %s\n", len, (unsigned long long)offset, strerror(errno));
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static DRESULT
+overlay_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct overlay_backend *ob = (struct overlay_backend *)be;
+
+	while (count > 0) {
+		uint64_t off = overlay_lookup(ob, sector);
+		UINT n = 1;
+
+		if (off) {
+			// sectors appended together are read together
+			while (n < count && overlay_lookup(ob, sector + n) == off + (uint64_t)n * FATBOY_SECTOR_SIZE) {
+				n++;
+			}
+			if (overlay_pread(ob->fd, buff, (size_t)n * FATBOY_SECTOR_SIZE, off) != 0) {
+				printf("Overlay read at %llu failed: %s\n", (unsigned long long)off, strerror(errno));
+				return RES_ERROR;
+			}
+		} else {
+			DRESULT res;
+
+			while (n < count && !overlay_lookup(ob, sector + n)) {
+				n++;
+			}
+			res = ob->base->read(ob->base, buff, sector, n);
+			if (res != RES_OK) {
+				return res;
+			}
+		}
+		buff += (size_t)n * FATBOY_SECTOR_SIZE;
+		sector += n;
+		count -= n;
+	}
+	return RES_OK;
+}
+
+/* Append sectors [sector, sector + n) taken from data[] as one record */
+static DRESULT
+overlay_append(struct overlay_backend *ob, const BYTE **data, LBA_t sector, UINT n) {
+	size_t len = OVERLAY_REC_SZ + (size_t)n * FATBOY_SECTOR_SIZE;
+	uint64_t start = ob->end;
+
+	put_le32(ob->stage, OVERLAY_REC_MAGIC);
+	put_le32(ob->stage + 4, n);
+	put_le64(ob->stage + 8, sector);
+	for (UINT i = 0; i < n; i++) {
+		memcpy(ob->stage + OVERLAY_REC_SZ + (size_t)i * FATBOY_SECTOR_SIZE, data[i], FATBOY_SECTOR_SIZE);
+	}
+	if (overlay_pwrite(ob->fd, ob->stage, len, start) != 0) {
+		return RES_ERROR;
+	}
+	ob->end += len;
+	for (UINT i = 0; i < n; i++) {
+		if (overlay_insert(ob, sector + i, start + OVERLAY_REC_SZ + (uint64_t)i * FATBOY_SECTOR_SIZE) != 0) {
+			return RES_ERROR;
+		}
+	}
+	return RES_OK;
+}
+
+/* Write count sectors from sector, data[i] holding sector + i */
+static DRESULT
+overlay_store(struct overlay_backend *ob, const BYTE **data, LBA_t sector, UINT count) {
+	UINT i = 0;
+
+	while (i < count) {
+		uint64_t off = overlay_lookup(ob, sector + i);
+		UINT n = 1;
+
+		if (off) {
+			if (overlay_pwrite(ob->fd, data[i], FATBOY_SECTOR_SIZE, off) != 0) {
+				ob->failed = 1;
+				return RES_ERROR;
+			}
+		} else {
+			DRESULT res;
+
+			while (i + n < count && n < OVERLAY_MAX_RUN && !overlay_lookup(ob, sector + i + n)) {
+				n++;
+			}
+			res = overlay_append(ob, data + i, sector + i, n);
+			if (res != RES_OK) {
+				ob->failed = 1;
+				return res;
+			}
+		}
+		i += n;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+overlay_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct overlay_backend *ob = (struct overlay_backend *)be;
+	const BYTE *data[OVERLAY_MAX_RUN];
+
+	if (sector + count > be->size / FATBOY_SECTOR_SIZE) {
+		return RES_PARERR;
+	}
+	while (count > 0) {
+		UINT n = count < OVERLAY_MAX_RUN ? count : OVERLAY_MAX_RUN;
+		DRESULT res;
+
+		for (UINT i = 0; i < n; i++) {
+			data[i] = buff + (size_t)i * FATBOY_SECTOR_SIZE;
+		}
+		res = overlay_store(ob, data, sector, n);
+		if (res != RES_OK) {
+			return res;
+		}
+		buff += (size_t)n * FATBOY_SECTOR_SIZE;
+		sector += n;
+		count -= n;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+overlay_writev(struct disk_backend *be, const struct iovec *iov, int iovcnt, LBA_t sector) {
+	struct overlay_backend *ob = (struct overlay_backend *)be;
+	const BYTE *data[OVERLAY_MAX_RUN];
+	UINT n = 0;
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (sector + len / FATBOY_SECTOR_SIZE > be->size / FATBOY_SECTOR_SIZE) {
+		return RES_PARERR;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		for (size_t off = 0; off < iov[i].iov_len; off += FATBOY_SECTOR_SIZE) {
+			data[n++] = (const BYTE *)iov[i].iov_base + off;
+			if (n == OVERLAY_MAX_RUN) {
+				if (overlay_store(ob, data, sector, n) != RES_OK) {
+					return RES_ERROR;
+				}
+				sector += n;
+				n = 0;
+			}
+		}
+	}
+	return n ? overlay_store(ob, data, sector, n) : RES_OK;
+}
+
+static DRESULT
+overlay_sync(struct disk_backend *be) {
+	// the delta is written through, like the file backend
+	return RES_OK;
+}
+
+static DRESULT
+overlay_flush(struct disk_backend *be) {
+	struct overlay_backend *ob = (struct overlay_backend *)be;
+
+	// only the delta is ever written
+	return backend_flush_fd(ob->fd);
+}
+
+static void
+overlay_free(struct overlay_backend *ob) {
+	if (ob->fd >= 0) {
+		close(ob->fd);
+	}
+	free(ob->keys);
+	free(ob->offsets);
+	free(ob->stage);
+	free(ob);
+}
+
+static DRESULT
+overlay_close(struct disk_backend *be) {
+	struct overlay_backend *ob = (struct overlay_backend *)be;
+	DRESULT res = ob->base->close(ob->base);
+
+	overlay_free(ob);
+	return res;
+}
+
+/*
+ * Kind of the record at pos: OVERLAY_REC_MAGIC for a complete data record,
+ * with n and sector filled in, OVERLAY_COMMIT_MAGIC for a commit record,
+ * 0 for anything else, such as a torn record or the end of the file.
+ */
+static uint32_t
+overlay_record(int fd, uint64_t pos, uint64_t file_size, uint64_t sectors, uint32_t *n, uint64_t *sector) {
+	BYTE rec[OVERLAY_REC_SZ];
+
+	if (pos + OVERLAY_REC_SZ > file_size || overlay_pread(fd, rec, sizeof(rec), pos) != 0) {
+		return 0;
+	}
+	*n = le32(rec + 4);
+	*sector = le64(rec + 8);
+	if (le32(rec) == OVERLAY_COMMIT_MAGIC && *n == 0) {
+		return OVERLAY_COMMIT_MAGIC;
+	}
+	if (le32(rec) != OVERLAY_REC_MAGIC || *n == 0 || *n > OVERLAY_MAX_RUN || *sector + *n > sectors
+			|| pos + OVERLAY_REC_SZ + (uint64_t)*n * FATBOY_SECTOR_SIZE > file_size) {
+		return 0;
+	}
+	return OVERLAY_REC_MAGIC;
+}
+
+/* Index the records of an existing delta, dropping a torn last record */
+static int
+overlay_scan(struct overlay_backend *ob, uint64_t file_size) {
+	uint64_t pos = OVERLAY_HDR_SZ;
+	uint32_t n;
+	uint64_t sector;
+
+	while (overlay_record(ob->fd, pos, file_size, ob->be.size / FATBOY_SECTOR_SIZE, &n, &sector) == OVERLAY_REC_MAGIC) {
+		for (uint32_t i = 0; i < n; i++) {
+			if (overlay_insert(ob, sector + i, pos + OVERLAY_REC_SZ + (uint64_t)i * FATBOY_SECTOR_SIZE) != 0) {
+				return -1;
+			}
+		}
+		pos += OVERLAY_REC_SZ + (uint64_t)n * FATBOY_SECTOR_SIZE;
+	}
+	if (pos != file_size) {
+		printf("Dropping %llu bytes of an incomplete overlay record\n", (unsigned long long)(file_size - pos));
+		if (ftruncate(ob->fd, pos) != 0) {
+			return -1;
+		}
+	}
+	ob->end = pos;
+	return 0;
+}
+
+/* FNV-1a of the first OVERLAY_PRINT_SZ bytes of be */
+static int
+overlay_fingerprint(struct disk_backend *be, uint64_t *print) {
+	size_t len = be->size < OVERLAY_PRINT_SZ ? be->size : OVERLAY_PRINT_SZ;
+	BYTE *buf = malloc(OVERLAY_PRINT_SZ);
+	uint64_t h = 0xCBF29CE484222325ULL;
+
+	if (!buf || be->read(be, buf, 0, len / FATBOY_SECTOR_SIZE) != RES_OK) {
+		free(buf);
+		return -1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ buf[i]) * 0x100000001B3ULL;
+	}
+	free(buf);
+	*print = h;
+	return 0;
+}
+
+/* Read and check the header of an existing delta against the image it is used with */
+static int
+overlay_check(int fd, const char *delta_path, struct disk_backend *image, int check_print) {
+	BYTE hdr[OVERLAY_HDR_SZ];
+	uint64_t print;
+
+	if (overlay_pread(fd, hdr, sizeof(hdr), 0) != 0 || memcmp(hdr, OVERLAY_MAGIC, 8) != 0) {
+		printf("ERROR: '%s' is not an overlay file\n", delta_path);
+		return -1;
+	}
+	if (le64(hdr + 8) != image->size) {
+		printf("ERROR: overlay '%s' belongs to a %llu byte image\n", delta_path, (unsigned long long)le64(hdr + 8));
+		return -1;
+	}
+	if (check_print && (overlay_fingerprint(image, &print) != 0 || print != le64(hdr + 16))) {
+		printf("ERROR: overlay '%s' was made for a different image\n", delta_path);
+		return -1;
+	}
+	return 0;
+}
+
+struct disk_backend *
+overlay_backend_open(struct disk_backend *base, const char *delta_path) {
+	struct overlay_backend *ob;
+	BYTE hdr[OVERLAY_HDR_SZ];
+	off_t file_size;
+
+	ob = calloc(1, sizeof(*ob));
+	if (!ob) {
+		return NULL;
+	}
+	ob->be.size = base->size;
+	ob->stage = malloc(OVERLAY_REC_SZ + (size_t)OVERLAY_MAX_RUN * FATBOY_SECTOR_SIZE);
+	ob->fd = open(delta_path, O_RDWR | O_CREAT, 0644);
+	if (!ob->stage || ob->fd < 0) {
+		printf("ERROR: could not open overlay '%s': %s\n", delta_path, strerror(errno));
+		overlay_free(ob);
+		return NULL;
+	}
+
+	file_size = lseek(ob->fd, 0, SEEK_END);
+	if (file_size == 0) {
+		uint64_t print;
+
+		memcpy(hdr, OVERLAY_MAGIC, 8);
+		put_le64(hdr + 8, base->size);
+		if (overlay_fingerprint(base, &print) != 0) {
+			overlay_free(ob);
+			return NULL;
+		}
+		put_le64(hdr + 16, print);
+		if (overlay_pwrite(ob->fd, hdr, sizeof(hdr), 0) != 0) {
+			overlay_free(ob);
+			return NULL;
+		}
+		file_size = sizeof(hdr);
+	} else if (overlay_check(ob->fd, delta_path, base, 1) != 0) {
+		overlay_free(ob);
+		return NULL;
+	}
+	if (overlay_scan(ob, file_size) != 0) {
+		overlay_free(ob);
+		return NULL;
+	}
+
+	ob->base = base;
+	ob->be.name = "overlay";
+	ob->be.sector_size = base->sector_size;
+	ob->be.block_size = base->block_size;
+	ob->be.read = overlay_read;
+	ob->be.write = overlay_write;
+	ob->be.writev = overlay_writev;
+	ob->be.sync = overlay_sync;
+	ob->be.flush = overlay_flush;
+	ob->be.close = overlay_close;
+	return &ob->be;
+}
+
+/*
+ * Write the data records of the delta open as fd to target. Returns the
+ * sectors written, or -1 on error; committed is set if the records end in
+ * a commit record.
+ */
+static int64_t
+overlay_replay(int fd, struct disk_backend *target, int *committed) {
+	uint64_t pos = OVERLAY_HDR_SZ, file_size = lseek(fd, 0, SEEK_END);
+	uint64_t sectors = target->size / FATBOY_SECTOR_SIZE;
+	int64_t applied = 0;
+	uint32_t kind, n;
+	uint64_t sector;
+	BYTE *buf = malloc((size_t)OVERLAY_MAX_RUN * FATBOY_SECTOR_SIZE);
+
+	if (!buf) {
+		return -1;
+	}
+	// records are in file order, each sector is in exactly one
+	while ((kind = overlay_record(fd, pos, file_size, sectors, &n, &sector)) == OVERLAY_REC_MAGIC) {
+		if (overlay_pread(fd, buf, (size_t)n * FATBOY_SECTOR_SIZE, pos + OVERLAY_REC_SZ) != 0
+				|| target->write(target, buf, sector, n) != RES_OK) {
+			free(buf);
+			return -1;
+		}
+		applied += n;
+		pos += OVERLAY_REC_SZ + (uint64_t)n * FATBOY_SECTOR_SIZE;
+	}
+	free(buf);
+	*committed = kind == OVERLAY_COMMIT_MAGIC;
+	if (!*committed && pos != file_size) {
+		printf("Ignoring an incomplete overlay record at %llu\n", (unsigned long long)pos);
+	}
+	return target->sync(target) == RES_OK ? applied : -1;
+}
+
+int
+overlay_apply(struct disk_backend *target, const char *delta_path) {
+	int64_t applied;
+	int fd, committed;
+
+	if (!target->write) {
+		printf("ERROR: the image is read only\n");
+		return -1;
+	}
+	fd = open(delta_path, O_RDONLY);
+	if (fd < 0) {
+		printf("ERROR: could not open overlay '%s': %s\n", delta_path, strerror(errno));
+		return -1;
+	}
+	if (overlay_check(fd, delta_path, target, 1) != 0) {
+		close(fd);
+		return -1;
+	}
+	applied = overlay_replay(fd, target, &committed);
+	close(fd);
+	if (applied < 0) {
+		printf("ERROR: applying overlay '%s' failed\n", delta_path);
+		return -1;
+	}
+	printf("Applied %lld sectors\n", (long long)applied);
+	return 0;
+}
+
+/* Copy a committed journal into the image and remove it */
+static int
+journal_replay(int fd, struct disk_backend *image, const char *journal_path) {
+	int committed;
+
+	if (overlay_replay(fd, image, &committed) < 0 || (image->flush && image->flush(image) != RES_OK)) {
+		printf("ERROR: could not write the journal '%s' into the image, it is kept for the next attempt\n", journal_path);
+		return -1;
+	}
+	unlink(journal_path);
+	return backend_sync_dir(journal_path) == RES_OK ? 0 : -1;
+}
+
+int
+journal_recover(struct disk_backend *image, const char *journal_path) {
+	uint64_t pos = OVERLAY_HDR_SZ, file_size;
+	uint32_t kind, n;
+	uint64_t sector;
+	int fd, ret = 0;
+
+	fd = open(journal_path, O_RDONLY);
+	if (fd < 0) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	// the start of the image may already have been replayed, only its size is checked
+	if (overlay_check(fd, journal_path, image, 0) != 0) {
+		close(fd);
+		return -1;
+	}
+	file_size = lseek(fd, 0, SEEK_END);
+	while ((kind = overlay_record(fd, pos, file_size, image->size / FATBOY_SECTOR_SIZE, &n, &sector)) == OVERLAY_REC_MAGIC) {
+		pos += OVERLAY_REC_SZ + (uint64_t)n * FATBOY_SECTOR_SIZE;
+	}
+	if (kind == OVERLAY_COMMIT_MAGIC) {
+		printf("Replaying the committed transaction in '%s'\n", journal_path);
+		ret = journal_replay(fd, image, journal_path);
+	} else {
+		printf("Rolling back the interrupted transaction in '%s'\n", journal_path);
+		unlink(journal_path);
+		ret = backend_sync_dir(journal_path) == RES_OK ? 0 : -1;
+	}
+	close(fd);
+	return ret;
+}
+
+/* Commit the transaction: seal the journal, then copy it into the image */
+static DRESULT
+journal_commit(struct overlay_backend *ob) {
+	BYTE rec[OVERLAY_REC_SZ] = { 0 };
+
+	put_le32(rec, OVERLAY_COMMIT_MAGIC);
+	if (overlay_pwrite(ob->fd, rec, sizeof(rec), ob->end) != 0 || backend_flush_fd(ob->fd) != RES_OK) {
+		printf("ERROR: could not commit the journal, the image is unchanged\n");
+		return RES_ERROR;
+	}
+	return journal_replay(ob->fd, ob->base, ob->journal) == 0 ? RES_OK : RES_ERROR;
+}
+
+static DRESULT
+journal_close(struct disk_backend *be) {
+	struct overlay_backend *ob = (struct overlay_backend *)be;
+	DRESULT res;
+
+	if (ob->failed) {
+		// committing would write a run with holes in it into the image
+		printf("ERROR: writing the journal failed, the transaction is rolled back and the image is unchanged\n");
+		unlink(ob->journal);
+		backend_sync_dir(ob->journal);
+		res = RES_ERROR;
+	} else if (!ob->used) {
+		unlink(ob->journal);
+		res = backend_sync_dir(ob->journal);
+	} else {
+		res = journal_commit(ob);
+	}
+	free(ob->journal);
+	if (overlay_close(be) != RES_OK) {
+		res = RES_ERROR;
+	}
+	return res;
+}
+
+struct disk_backend *
+journal_backend_open(struct disk_backend *image, const char *journal_path) {
+	struct overlay_backend *ob;
+	struct disk_backend *be;
+	char *path = strdup(journal_path);
+
+	if (!path) {
+		return NULL;
+	}
+	// anything left from an interrupted run has been dealt with by now
+	unlink(journal_path);
+	be = overlay_backend_open(image, journal_path);
+	if (!be) {
+		free(path);
+		return NULL;
+	}
+	ob = (struct overlay_backend *)be;
+	ob->journal = path;
+	// a commit record is worthless if the journal itself can vanish in a crash
+	if (backend_sync_dir(journal_path) != RES_OK) {
+		free(path);
+		ob->journal = NULL;
+		overlay_free(ob);
+		unlink(journal_path);
+		return NULL;
+	}
+	ob->be.name = "journal";
+	ob->be.close = journal_close;
+	return be;
+}
+
+static int
+is_zero(const BYTE *buff, size_t len) {
+	return buff[0] == 0 && memcmp(buff, buff + 1, len - 1) == 0;
+}
+
+int
+backend_export(struct disk_backend *be, const char *path) {
+	const size_t chunk = 1 << 20, block = 4096;
+	BYTE *buf = malloc(chunk);
+	uint64_t pos = 0;
+	int fd, ret = 0;
+
+	// never replace an existing file, it may well be the image being read
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		printf("ERROR: '%s' already exists\n", path);
+		free(buf);
+		return -1;
+	}
+	if (!buf || fd < 0) {
+		printf("ERROR: could not create '%s': %s\n", path, strerror(errno));
+		free(buf);
+		if (fd >= 0) {
+			close(fd);
+			unlink(path);
+		}
+		return -1;
+	}
+	// all-zero blocks are left as holes
+	while (pos < be->size && ret == 0) {
+		size_t len = be->size - pos < chunk ? be->size - pos : chunk;
+
+		if (be->read(be, buf, pos / FATBOY_SECTOR_SIZE, len / FATBOY_SECTOR_SIZE) != RES_OK) {
+			ret = -1;
+			break;
+		}
+		for (size_t off = 0; off < len && ret == 0; off += block) {
+			size_t n = len - off < block ? len - off : block;
+
+			if (!is_zero(buf + off, n)) {
+				ret = overlay_pwrite(fd, buf + off, n, pos + off);
+			}
+		}
+		pos += len;
+	}
+	if (ret == 0 && ftruncate(fd, be->size) != 0) {
+		printf("ERROR: could not size '%s': %s\n", path, strerror(errno));
+		ret = -1;
+	}
+	if (close(fd) != 0 && ret == 0) {
+		printf("ERROR: closing '%s' failed: %s\n", path, strerror(errno));
+		ret = -1;
+	}
+	// the file was created above, a partial export is of no use
+	if (ret != 0) {
+		unlink(path);
+	}
+	free(buf);
+	return ret;
+}
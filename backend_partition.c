@@ -0,0 +1,282 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+
+/*
+ * One partition of a whole disk image. The partition is looked up in the
+ * MBR (primary 1-4, logical 5 and up) or GPT (entry number) and the filter
+ * shifts every request by its start, so the file system code sees the
+ * partition as the whole image and only the partition is ever touched.
+ */
+
+#define MBR_MAX_LOGICAL	128	// EBR chain links followed before giving up
+
+struct part_backend {
+	struct disk_backend be;
+	struct disk_backend *lower;
+	LBA_t start;		// in backend units
+	LBA_t count;
+};
+
+static uint32_t
+le32(const BYTE *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+le64(const BYTE *p) {
+	return le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+/* Read one disk sector of ss bytes at lba */
+static int
+read_lba(struct disk_backend *be, BYTE *buf, uint64_t lba, unsigned ss) {
+	uint64_t unit = lba * (ss / FATBOY_SECTOR_SIZE);
+	UINT n = ss / FATBOY_SECTOR_SIZE;
+
+	if ((unit + n) * FATBOY_SECTOR_SIZE > be->size) {
+		return -1;
+	}
+	return be->read(be, buf, unit, n) == RES_OK ? 0 : -1;
+}
+
+static int
+gpt_find(struct disk_backend *be, unsigned part, unsigned ss, uint64_t *start, uint64_t *count) {
+	BYTE buf[_MAX_SS];
+	uint64_t entries_lba;
+	uint32_t nentries, entry_size, per_sector;
+	const BYTE *e;
+
+	if (read_lba(be, buf, 1, ss) != 0 || memcmp(buf, "EFI PART", 8) != 0) {
+		printf("ERROR: no GPT header in the second %u byte sector\n", ss);
+		return -1;
+	}
+	entries_lba = le64(buf + 72);
+	nentries = le32(buf + 80);
+	entry_size = le32(buf + 84);
+	if (entry_size < 128 || entry_size > ss || ss % entry_size != 0) {
+		printf("ERROR: unsupported GPT entry size %u\n", entry_size);
+		return -1;
+	}
+	if (part > nentries) {
+		printf("ERROR: the GPT has only %u entries\n", nentries);
+		return -1;
+	}
+	per_sector = ss / entry_size;
+	if (read_lba(be, buf, entries_lba + (part - 1) / per_sector, ss) != 0) {
+		return -1;
+	}
+	e = buf + ((part - 1) % per_sector) * entry_size;
+	for (int i = 0; i < 16; i++) {
+		if (e[i]) {
+			*start = le64(e + 32);
+			*count = le64(e + 40) - *start + 1;
+			return le64(e + 40) >= *start ? 0 : -1;
+		}
+	}
+	printf("ERROR: GPT partition %u is unused\n", part);
+	return -1;
+}
+
+static int
+mbr_is_extended(BYTE type) {
+	return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+/* Logical partition part (5 and up) in the extended partition at ext_lba */
+static int
+mbr_find_logical(struct disk_backend *be, unsigned part, unsigned ss, uint64_t ext_lba, uint64_t *start, uint64_t *count) {
+	BYTE ebr[_MAX_SS];
+	uint64_t lba = ext_lba;
+
+	for (unsigned n = 5; n < 5 + MBR_MAX_LOGICAL; n++) {
+		const BYTE *pte = ebr + 446;
+
+		if (read_lba(be, ebr, lba, ss) != 0 || ebr[510] != 0x55 || ebr[511] != 0xAA) {
+			break;
+		}
+		if (n == part) {
+			*start = lba + le32(pte + 8);
+			*count = le32(pte + 12);
+			return pte[4] && *count ? 0 : -1;
+		}
+		// the second entry links to the next EBR, relative to the extended partition
+		if (!mbr_is_extended(pte[16 + 4])) {
+			break;
+		}
+		lba = ext_lba + le32(pte + 16 + 8);
+	}
+	printf("ERROR: there is no logical partition %u\n", part);
+	return -1;
+}
+
+static int
+partition_find(struct disk_backend *be, unsigned part, unsigned ss, uint64_t *start, uint64_t *count) {
+	BYTE mbr[_MAX_SS];
+
+	if (read_lba(be, mbr, 0, ss) != 0 || mbr[510] != 0x55 || mbr[511] != 0xAA) {
+		printf("ERROR: the image has no partition table\n");
+		return -1;
+	}
+	for (int i = 0; i < 4; i++) {
+		if (mbr[446 + i * 16 + 4] == 0xEE) {
+			return gpt_find(be, part, ss, start, count);
+		}
+	}
+	if (part > 4) {
+		for (int i = 0; i < 4; i++) {
+			const BYTE *pte = mbr + 446 + i * 16;
+
+			if (mbr_is_extended(pte[4])) {
+				return mbr_find_logical(be, part, ss, le32(pte + 8), start, count);
+			}
+		}
+		printf("ERROR: there is no logical partition %u\n", part);
+		return -1;
+	}
+	{
+		const BYTE *pte = mbr + 446 + (part - 1) * 16;
+
+		*start = le32(pte + 8);
+		*count = le32(pte + 12);
+		if (!pte[4] || !*count || mbr_is_extended(pte[4])) {
+			printf("ERROR: MBR partition %u is %s\n", part, pte[4] ? "the extended partition" : "unused");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static DRESULT
+part_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct part_backend *pb = (struct part_backend *)be;
+
+	if (sector + count > pb->count) {
+		return RES_PARERR;
+	}
+	return pb->lower->read(pb->lower, buff, pb->start + sector, count);
+}
+
+static DRESULT
+part_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct part_backend *pb = (struct part_backend *)be;
+
+	if (sector + count > pb->count) {
+		return RES_PARERR;
+	}
+	return pb->lower->write(pb->lower, buff, pb->start + sector, count);
+}
+
+static DRESULT
+part_writev(struct disk_backend *be, const struct iovec *iov, int iovcnt, LBA_t sector) {
+	struct part_backend *pb = (struct part_backend *)be;
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (sector + len / FATBOY_SECTOR_SIZE > pb->count) {
+		return RES_PARERR;
+	}
+	return pb->lower->writev(pb->lower, iov, iovcnt, pb->start + sector);
+}
+
+static DRESULT
+part_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct part_backend *pb = (struct part_backend *)be;
+
+	if (sector + count > pb->count) {
+		return RES_PARERR;
+	}
+	if (!pb->lower->trim) {
+		return RES_PARERR;
+	}
+	return pb->lower->trim(pb->lower, pb->start + sector, count);
+}
+
+static DRESULT
+part_sync(struct disk_backend *be) {
+	struct part_backend *pb = (struct part_backend *)be;
+
+	return pb->lower->sync(pb->lower);
+}
+
+static DRESULT
+part_flush(struct disk_backend *be) {
+	struct part_backend *pb = (struct part_backend *)be;
+
+	return pb->lower->flush(pb->lower);
+}
+
+static DRESULT
+part_close(struct disk_backend *be) {
+	struct part_backend *pb = (struct part_backend *)be;
+	DRESULT res = pb->lower->close(pb->lower);
+
+	free(pb);
+	return res;
+}
+
+struct disk_backend *
+partition_backend_open(struct disk_backend *lower, unsigned part, unsigned sector_size) {
+	struct part_backend *pb;
+	uint64_t start, count, units = sector_size / FATBOY_SECTOR_SIZE;
+
+	if (part == 0 || partition_find(lower, part, sector_size, &start, &count) != 0) {
+		return NULL;
+	}
+	if (start == 0 || (start + count) * units * FATBOY_SECTOR_SIZE > lower->size) {
+		printf("ERROR: partition %u (sectors %llu+%llu) lies outside the image\n", part,
+				(unsigned long long)start, (unsigned long long)count);
+		return NULL;
+	}
+
+	pb = calloc(1, sizeof(*pb));
+	if (!pb) {
+		return NULL;
+	}
+	pb->lower = lower;
+	pb->start = start * units;
+	pb->count = count * units;
+
+	pb->be.name = lower->name;
+	pb->be.size = (uint64_t)pb->count * FATBOY_SECTOR_SIZE;
+	pb->be.sector_size = lower->sector_size;
+	pb->be.block_size = lower->block_size;
+	pb->be.trim_zeroes = lower->trim_zeroes;
+	pb->be.read = part_read;
+	pb->be.write = lower->write ? part_write : NULL;
+	pb->be.writev = lower->writev ? part_writev : NULL;
+	pb->be.trim = part_trim;
+	pb->be.sync = part_sync;
+	pb->be.flush = lower->flush ? part_flush : NULL;
+	pb->be.close = part_close;
+	return &pb->be;
+}
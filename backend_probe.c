@@ -0,0 +1,219 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#define _GNU_SOURCE	// fallocate
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#elif defined(__APPLE__)
+#include <sys/disk.h>
+#endif
+#include "backend.h"
+#include "elmchan_impl.h"
+#include "stats.h"
+
+/*
+ * Work out how big the target is and how it wants to be written to.
+ * Regular image files are sized with fstat. Block devices report a size of
+ * zero there, so ask the driver for the capacity and the logical and
+ * physical sector sizes instead.
+ */
+
+#if defined(__linux__)
+/* SD and MMC cards publish their erase block size through sysfs */
+static uint32_t
+erase_block_size(const struct stat *st) {
+	static const char *const fmt[] = {
+		"/sys/dev/block/%u:%u/device/preferred_erase_size",	// whole card
+		"/sys/dev/block/%u:%u/../device/preferred_erase_size",	// partition on it
+	};
+	unsigned long erase = 0;
+
+	for (size_t i = 0; i < sizeof(fmt) / sizeof(fmt[0]) && !erase; i++) {
+		char path[128];
+		FILE *f;
+
+		snprintf(path, sizeof(path), fmt[i], major(st->st_rdev), minor(st->st_rdev));
+		f = fopen(path, "r");
+		if (f) {
+			if (fscanf(f, "%lu", &erase) != 1) {
+				erase = 0;
+			}
+			fclose(f);
+		}
+	}
+	return erase <= UINT32_MAX ? (uint32_t)erase : 0;
+}
+#endif
+
+int
+backend_probe(int fd, const char *path, struct disk_backend *be) {
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		printf("ERROR: could not stat image '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	be->size = st.st_size;
+	be->sector_size = 0;
+	be->block_size = 0;
+	if (!S_ISBLK(st.st_mode)) {
+		be->trim_zeroes = 1;	// a punched hole reads as zeros
+		return 0;
+	}
+	be->trim_zeroes = 0;
+
+#if defined(__linux__)
+	{
+		uint64_t bytes;
+		int lss = 0;
+		unsigned int pbs = 0;
+
+		if (ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
+			printf("ERROR: could not get the size of '%s': %s\n", path, strerror(errno));
+			return -1;
+		}
+		be->size = bytes;
+		be->sector_size = FATBOY_SECTOR_SIZE;
+		if (ioctl(fd, BLKSSZGET, &lss) == 0 && lss > 0) {
+			be->sector_size = lss;
+		}
+		if (ioctl(fd, BLKPBSZGET, &pbs) == 0) {
+			be->block_size = pbs;
+		}
+		uint32_t erase = erase_block_size(&st);
+		if (erase > be->block_size) {
+			be->block_size = erase;
+		}
+	}
+#elif defined(__APPLE__)
+	{
+		uint64_t count;
+		uint32_t lss, pbs;
+
+		if (ioctl(fd, DKIOCGETBLOCKSIZE, &lss) != 0 || ioctl(fd, DKIOCGETBLOCKCOUNT, &count) != 0) {
+			printf("ERROR: could not get the size of '%s': %s\n", path, strerror(errno));
+			return -1;
+		}
+		be->size = count * lss;
+		be->sector_size = lss;
+		if (ioctl(fd, DKIOCGETPHYSICALBLOCKSIZE, &pbs) == 0) {
+			be->block_size = pbs;
+		}
+	}
+#else
+	printf("ERROR: block devices are not supported on this platform\n");
+	return -1;
+#endif
+	return 0;
+}
+
+/*
+ * Freed clusters do not need to keep occupying storage. Image files get a
+ * hole punched so they stay sparse, block devices get a discard so flash
+ * can erase ahead of time. Targets that support neither are left alone.
+ */
+DRESULT
+backend_discard(int fd, const struct disk_backend *be, uint64_t offset, uint64_t len) {
+	int ret;
+
+	if (len == 0) {
+		return RES_OK;
+	}
+	io_stats.syscalls++;
+#if defined(__linux__)
+	if (be->sector_size) {
+		uint64_t range[2] = { offset, len };
+		ret = ioctl(fd, BLKDISCARD, range);
+	} else {
+		ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+	}
+#elif defined(F_PUNCHHOLE)
+	struct fpunchhole hole = { .fp_offset = offset, .fp_length = len };
+	ret = be->sector_size ? (errno = ENOTSUP, -1) : fcntl(fd, F_PUNCHHOLE, &hole);
+#else
+	errno = ENOTSUP;
+	ret = -1;
+#endif
+	if (ret == 0) {
+		return RES_OK;
+	}
+	if (errno == EOPNOTSUPP || errno == ENOTSUP || errno == ENOTTY || errno == ENOSYS || errno == EINVAL) {
+		return RES_PARERR;
+	}
+	printf("Discard of %llu bytes at %llu failed: %s\n", (unsigned long long)len,
+			(unsigned long long)offset, strerror(errno));
+	return RES_ERROR;
+}
+
+DRESULT
+backend_flush_fd(int fd) {
+	int ret;
+
+	io_stats.syscalls++;
+
+#if defined(__APPLE__)
+	// fsync only reaches the drive cache on macOS
+	ret = fcntl(fd, F_FULLFSYNC);
+	if (ret != 0) {
+		ret = fsync(fd);
+	}
+#else
+	ret = fdatasync(fd);
+#endif
+	if (ret != 0 && errno != EINVAL && errno != EROFS) {
+		printf("ERROR: flushing the image failed: %s\n", strerror(errno));
+		return RES_ERROR;
+	}
+	return RES_OK;
+}
+
+DRESULT
+backend_sync_dir(const char *path) {
+	char buf[4096];
+	DRESULT res;
+	int fd;
+
+	// dirname may modify its argument
+	snprintf(buf, sizeof(buf), "%s", path);
+	fd = open(dirname(buf), O_RDONLY);
+	if (fd < 0) {
+		printf("ERROR: could not open the directory of '%s': %s\n", path, strerror(errno));
+		return RES_ERROR;
+	}
+	res = backend_flush_fd(fd);
+	close(fd);
+	return res;
+}
@@ -0,0 +1,704 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+#include "stats.h"
+
+/*
+ * QEMU qcow2 images. Guest clusters are found through the L1 table, kept
+ * in memory, and L2 tables, of which a small LRU set is cached. Clusters
+ * that were never written read from the backing file if there is one, or
+ * as zeros. Writing one allocates a new cluster at the end of the file,
+ * fills it with the backing data around the written part and points the
+ * L2 entry at it (copy on write). Refcounts of new clusters, including
+ * new L2 tables and refcount blocks, are set as they are allocated; dirty
+ * L2 tables are written back on sync and eviction.
+ *
+ * Internal snapshots (clusters shared with refcount > 1), compressed
+ * clusters, encryption and refcount widths other than 16 bits are not
+ * supported; images using them are refused or fail the affected I/O.
+ */
+
+#define QCOW2_MAGIC		0x514649FB	// "QFI\xfb"
+#define QCOW2_L2_CACHE		16		// L2 tables kept in memory
+
+#define QCOW2_OFLAG_COPIED	(1ULL << 63)	// refcount is exactly 1
+#define QCOW2_OFLAG_COMPRESSED	(1ULL << 62)
+#define QCOW2_OFLAG_ZERO	1ULL		// v3: cluster reads as zeros
+#define QCOW2_OFFSET_MASK	0x00FFFFFFFFFFFE00ULL
+
+struct qcow2_l2 {
+	uint64_t offset;	// host offset of the table, 0 for an unused slot
+	uint64_t *table;
+	uint64_t last_use;
+	int dirty;
+};
+
+struct qcow2_backend {
+	struct disk_backend be;
+	int fd;
+	int rdonly;
+	uint32_t version;
+	uint32_t cluster_bits;
+	uint32_t cluster_size;
+	uint32_t l2_entries;
+	uint64_t *l1;
+	uint32_t l1_size;
+	uint64_t l1_offset;
+	uint64_t *rt;		// refcount table
+	uint32_t rt_entries;
+	uint64_t rt_offset;
+	uint64_t next_free;	// where the next cluster is appended
+	uint64_t autoclear;	// v3 autoclear feature bits, cleared by the first write
+	struct qcow2_l2 l2[QCOW2_L2_CACHE];
+	uint64_t clock;
+	struct disk_backend *backing;
+	BYTE *cow_buf;		// one cluster of guest data being copied on write
+	BYTE *meta_buf;		// one cluster of L2 table or refcount block being written
+	BYTE *gather_buf;	// one cluster collected from a gathered write
+};
+
+static uint64_t
+be64(const BYTE *p) {
+	return (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 | (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32
+		| (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 | (uint64_t)p[6] << 8 | p[7];
+}
+
+static uint32_t
+be32(const BYTE *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void
+put_be64(BYTE *p, uint64_t v) {
+	for (int i = 7; i >= 0; i--, v >>= 8) {
+		p[i] = v;
+	}
+}
+
+static int
+qcow2_pread(struct qcow2_backend *qb, void *buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		io_stats.syscalls++;
+		ssize_t n = pread(qb->fd, (BYTE *)buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			printf("qcow2 read of %zu bytes at %llu failed: %s\n", len, (unsigned long long)offset, strerror(errno));
+			return -1;
+		}
+		if (n == 0) {
+			// metadata past the end of the file was never written
+			memset((BYTE *)buf + done, 0, len - done);
+			break;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int
+qcow2_pwrite(struct qcow2_backend *qb, const void *buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		io_stats.syscalls++;
+		ssize_t n = pwrite(qb->fd, (const BYTE *)buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			printf("qcow2 write of %zu bytes at %llu failed: %s\n", len, (unsigned long long)offset, strerror(errno));
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int
+qcow2_put_entry(struct qcow2_backend *qb, uint64_t table, uint32_t idx, uint64_t value) {
+	BYTE buf[8];
+
+	put_be64(buf, value);
+	return qcow2_pwrite(qb, buf, sizeof(buf), table + (uint64_t)idx * 8);
+}
+
+static int
+qcow2_set_refcount(struct qcow2_backend *qb, uint64_t host, uint16_t value) {
+	uint64_t idx = host >> qb->cluster_bits;
+	uint32_t per_block = qb->cluster_size / 2;
+	uint64_t rt_idx = idx / per_block;
+	BYTE buf[2] = { value >> 8, value };
+
+	if (rt_idx >= qb->rt_entries) {
+		printf("ERROR: qcow2 refcount table is full\n");
+		return -1;
+	}
+	if (!(qb->rt[rt_idx] & QCOW2_OFFSET_MASK)) {
+		// the new refcount block describes itself or a following block does
+		uint64_t block = qb->next_free;
+
+		qb->next_free += qb->cluster_size;
+		memset(qb->meta_buf, 0, qb->cluster_size);
+		if (qcow2_pwrite(qb, qb->meta_buf, qb->cluster_size, block) != 0
+				|| qcow2_put_entry(qb, qb->rt_offset, rt_idx, block) != 0) {
+			return -1;
+		}
+		qb->rt[rt_idx] = block;
+		if (qcow2_set_refcount(qb, block, 1) != 0) {
+			return -1;
+		}
+	}
+	return qcow2_pwrite(qb, buf, sizeof(buf), (qb->rt[rt_idx] & QCOW2_OFFSET_MASK) + (idx % per_block) * 2);
+}
+
+static int
+qcow2_alloc(struct qcow2_backend *qb, uint64_t *host) {
+	*host = qb->next_free;
+	qb->next_free += qb->cluster_size;
+	return qcow2_set_refcount(qb, *host, 1);
+}
+
+static int
+qcow2_l2_writeback(struct qcow2_backend *qb, struct qcow2_l2 *l2) {
+	BYTE *raw = qb->meta_buf;
+
+	if (!l2->dirty) {
+		return 0;
+	}
+	for (uint32_t i = 0; i < qb->l2_entries; i++) {
+		put_be64(raw + (size_t)i * 8, l2->table[i]);
+	}
+	if (qcow2_pwrite(qb, raw, qb->cluster_size, l2->offset) != 0) {
+		return -1;
+	}
+	l2->dirty = 0;
+	return 0;
+}
+
+/*
+ * L2 table for l1_idx, or NULL if there is none and alloc is not set.
+ * With alloc set a missing table is created, zeroed, and hooked into L1.
+ */
+static struct qcow2_l2 *
+qcow2_l2_get(struct qcow2_backend *qb, uint32_t l1_idx, int alloc, int *err) {
+	uint64_t offset = qb->l1[l1_idx] & QCOW2_OFFSET_MASK;
+	struct qcow2_l2 *l2 = &qb->l2[0];
+	int fresh = 0;
+
+	*err = 0;
+	if (!offset) {
+		if (!alloc) {
+			return NULL;
+		}
+		if (qcow2_alloc(qb, &offset) != 0) {
+			goto fail;
+		}
+		fresh = 1;
+	} else if (alloc && !(qb->l1[l1_idx] & QCOW2_OFLAG_COPIED)) {
+		printf("ERROR: qcow2 L2 table is shared with a snapshot\n");
+		goto fail;
+	}
+
+	for (int i = 0; i < QCOW2_L2_CACHE; i++) {
+		if (qb->l2[i].offset == offset) {
+			qb->l2[i].last_use = ++qb->clock;
+			return &qb->l2[i];
+		}
+		if (qb->l2[i].last_use < l2->last_use) {
+			l2 = &qb->l2[i];
+		}
+	}
+
+	if (qcow2_l2_writeback(qb, l2) != 0) {
+		goto fail;
+	}
+	l2->offset = 0;
+	if (fresh) {
+		memset(l2->table, 0, (size_t)qb->l2_entries * 8);
+		memset(qb->meta_buf, 0, qb->cluster_size);
+		// the table has to be on disk before L1 points at it
+		if (qcow2_pwrite(qb, qb->meta_buf, qb->cluster_size, offset) != 0
+				|| qcow2_put_entry(qb, qb->l1_offset, l1_idx, offset | QCOW2_OFLAG_COPIED) != 0) {
+			goto fail;
+		}
+		qb->l1[l1_idx] = offset | QCOW2_OFLAG_COPIED;
+	} else {
+		if (qcow2_pread(qb, qb->meta_buf, qb->cluster_size, offset) != 0) {
+			goto fail;
+		}
+		for (uint32_t i = 0; i < qb->l2_entries; i++) {
+			l2->table[i] = be64(qb->meta_buf + (size_t)i * 8);
+		}
+	}
+	l2->offset = offset;
+	l2->last_use = ++qb->clock;
+	return l2;
+
+fail:
+	*err = 1;
+	return NULL;
+}
+
+/* Read a guest range that has no cluster of its own */
+static int
+qcow2_read_unallocated(struct qcow2_backend *qb, BYTE *buf, uint64_t pos, size_t len) {
+	uint64_t backing_size = qb->backing ? qb->backing->size : 0;
+	size_t n = pos < backing_size ? (backing_size - pos < len ? backing_size - pos : len) : 0;
+
+	if (n && qb->backing->read(qb->backing, buf, pos / FATBOY_SECTOR_SIZE, n / FATBOY_SECTOR_SIZE) != RES_OK) {
+		return -1;
+	}
+	memset(buf + n, 0, len - n);
+	return 0;
+}
+
+static int
+qcow2_entry(struct qcow2_backend *qb, uint64_t pos, uint64_t *entry) {
+	uint64_t cluster = pos >> qb->cluster_bits;
+	uint64_t l1_idx = cluster / qb->l2_entries;
+	struct qcow2_l2 *l2;
+	int err;
+
+	if (l1_idx >= qb->l1_size) {
+		printf("ERROR: qcow2 offset %llu is beyond the L1 table\n", (unsigned long long)pos);
+		return -1;
+	}
+	l2 = qcow2_l2_get(qb, l1_idx, 0, &err);
+	*entry = l2 ? l2->table[cluster % qb->l2_entries] : 0;
+	return err ? -1 : 0;
+}
+
+static DRESULT
+qcow2_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct qcow2_backend *qb = (struct qcow2_backend *)be;
+	uint64_t pos = (uint64_t)sector * FATBOY_SECTOR_SIZE;
+	size_t len = (size_t)count * FATBOY_SECTOR_SIZE;
+
+	while (len > 0) {
+		uint32_t off = pos & (qb->cluster_size - 1);
+		size_t n = qb->cluster_size - off < len ? qb->cluster_size - off : len;
+		uint64_t entry, host;
+		int ret;
+
+		if (qcow2_entry(qb, pos, &entry) != 0) {
+			return RES_ERROR;
+		}
+		host = entry & QCOW2_OFFSET_MASK;
+		if (entry & QCOW2_OFLAG_COMPRESSED) {
+			printf("ERROR: compressed qcow2 clusters are not supported\n");
+			return RES_ERROR;
+		} else if (entry & QCOW2_OFLAG_ZERO) {
+			// also when a preallocated host cluster is attached
+			memset(buff, 0, n);
+			ret = 0;
+		} else if (host) {
+			ret = qcow2_pread(qb, buff, n, host + off);
+		} else {
+			ret = qcow2_read_unallocated(qb, buff, pos, n);
+		}
+		if (ret != 0) {
+			return RES_ERROR;
+		}
+		buff += n;
+		pos += n;
+		len -= n;
+	}
+	return RES_OK;
+}
+
+static int
+is_zero(const BYTE *buff, size_t len) {
+	return buff[0] == 0 && memcmp(buff, buff + 1, len - 1) == 0;
+}
+
+/* v3: autoclear features (e.g. bitmaps) are invalid once the image is changed by us */
+static int
+qcow2_clear_autoclear(struct qcow2_backend *qb) {
+	BYTE zero[8] = { 0 };
+
+	if (!qb->autoclear) {
+		return 0;
+	}
+	if (qcow2_pwrite(qb, zero, sizeof(zero), 88) != 0) {
+		return -1;
+	}
+	qb->autoclear = 0;
+	return 0;
+}
+
+static DRESULT
+qcow2_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct qcow2_backend *qb = (struct qcow2_backend *)be;
+	uint64_t pos = (uint64_t)sector * FATBOY_SECTOR_SIZE;
+	size_t len = (size_t)count * FATBOY_SECTOR_SIZE;
+
+	if (qcow2_clear_autoclear(qb) != 0) {
+		return RES_ERROR;
+	}
+	while (len > 0) {
+		uint32_t off = pos & (qb->cluster_size - 1);
+		size_t n = qb->cluster_size - off < len ? qb->cluster_size - off : len;
+		uint64_t cluster = pos >> qb->cluster_bits;
+		uint64_t l1_idx = cluster / qb->l2_entries;
+		uint32_t l2_idx = cluster % qb->l2_entries;
+		struct qcow2_l2 *l2;
+		uint64_t entry, host;
+		int err;
+
+		if (l1_idx >= qb->l1_size) {
+			printf("ERROR: qcow2 offset %llu is beyond the L1 table\n", (unsigned long long)pos);
+			return RES_ERROR;
+		}
+		l2 = qcow2_l2_get(qb, l1_idx, 1, &err);
+		if (!l2) {
+			return RES_ERROR;
+		}
+		entry = l2->table[l2_idx];
+		host = entry & QCOW2_OFFSET_MASK;
+
+		if (entry & QCOW2_OFLAG_COMPRESSED) {
+			printf("ERROR: compressed qcow2 clusters are not supported\n");
+			return RES_ERROR;
+		}
+		if (host && !(entry & QCOW2_OFLAG_COPIED)) {
+			printf("ERROR: qcow2 cluster is shared with a snapshot\n");
+			return RES_ERROR;
+		}
+
+		if (is_zero(buff, n) && ((entry & QCOW2_OFLAG_ZERO) || (!host && !qb->backing))) {
+			// already reads as zeros, no need for a cluster
+		} else if (host && !(entry & QCOW2_OFLAG_ZERO)) {
+			if (qcow2_pwrite(qb, buff, n, host + off) != 0) {
+				return RES_ERROR;
+			}
+		} else {
+			// a preallocated zero cluster keeps its host cluster, its old contents are stale
+			if (!host && qcow2_alloc(qb, &host) != 0) {
+				return RES_ERROR;
+			}
+			if (n < qb->cluster_size) {
+				uint64_t base = pos - off;
+
+				if (entry & QCOW2_OFLAG_ZERO) {
+					memset(qb->cow_buf, 0, qb->cluster_size);
+				} else if (qcow2_read_unallocated(qb, qb->cow_buf, base, qb->cluster_size) != 0) {
+					return RES_ERROR;
+				}
+				memcpy(qb->cow_buf + off, buff, n);
+			}
+			if (qcow2_pwrite(qb, n < qb->cluster_size ? qb->cow_buf : buff, qb->cluster_size, host) != 0) {
+				return RES_ERROR;
+			}
+			l2->table[l2_idx] = host | QCOW2_OFLAG_COPIED;
+			l2->dirty = 1;
+		}
+		buff += n;
+		pos += n;
+		len -= n;
+	}
+	return RES_OK;
+}
+
+/*
+ * Gathered writes, e.g. from the write combiner, are cut at cluster
+ * boundaries so a run covering a whole cluster goes down in one piece
+ * and a new cluster for it is written without copying the old contents.
+ */
+static DRESULT
+qcow2_writev(struct disk_backend *be, const struct iovec *iov, int iovcnt, LBA_t sector) {
+	struct qcow2_backend *qb = (struct qcow2_backend *)be;
+	UINT per_cluster = qb->cluster_size / FATBOY_SECTOR_SIZE;
+	UINT held = 0;		// sectors collected in gather_buf for sector onwards
+	DRESULT res;
+
+	for (int i = 0; i < iovcnt; i++) {
+		const BYTE *p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left > 0) {
+			UINT room = per_cluster - (UINT)((sector + held) % per_cluster);
+			size_t n = (size_t)room * FATBOY_SECTOR_SIZE < left ? (size_t)room * FATBOY_SECTOR_SIZE : left;
+
+			memcpy(qb->gather_buf + (size_t)held * FATBOY_SECTOR_SIZE, p, n);
+			held += n / FATBOY_SECTOR_SIZE;
+			p += n;
+			left -= n;
+			if ((sector + held) % per_cluster == 0) {
+				res = qcow2_write(be, qb->gather_buf, sector, held);
+				if (res != RES_OK) {
+					return res;
+				}
+				sector += held;
+				held = 0;
+			}
+		}
+	}
+	return held ? qcow2_write(be, qb->gather_buf, sector, held) : RES_OK;
+}
+
+/* Release the host storage of whole allocated clusters in the range */
+static DRESULT
+qcow2_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct qcow2_backend *qb = (struct qcow2_backend *)be;
+	uint64_t pos = (uint64_t)sector * FATBOY_SECTOR_SIZE;
+	uint64_t end = pos + (uint64_t)count * FATBOY_SECTOR_SIZE;
+	DRESULT res = RES_OK;
+
+	if (qcow2_clear_autoclear(qb) != 0) {
+		return RES_ERROR;
+	}
+	pos = (pos + qb->cluster_size - 1) & ~(uint64_t)(qb->cluster_size - 1);
+	for (; pos + qb->cluster_size <= end && res == RES_OK; pos += qb->cluster_size) {
+		uint64_t entry;
+
+		if (qcow2_entry(qb, pos, &entry) != 0) {
+			return RES_ERROR;
+		}
+		if ((entry & QCOW2_OFFSET_MASK) && !(entry & QCOW2_OFLAG_COMPRESSED)) {
+			res = backend_discard(qb->fd, be, entry & QCOW2_OFFSET_MASK, qb->cluster_size);
+		}
+	}
+	return res;
+}
+
+static DRESULT
+qcow2_sync(struct disk_backend *be) {
+	struct qcow2_backend *qb = (struct qcow2_backend *)be;
+
+	for (int i = 0; i < QCOW2_L2_CACHE; i++) {
+		if (qcow2_l2_writeback(qb, &qb->l2[i]) != 0) {
+			return RES_ERROR;
+		}
+	}
+	return RES_OK;
+}
+
+static DRESULT
+qcow2_flush(struct disk_backend *be) {
+	struct qcow2_backend *qb = (struct qcow2_backend *)be;
+	DRESULT res = qcow2_sync(be);
+
+	return res == RES_OK ? backend_flush_fd(qb->fd) : res;
+}
+
+static void
+qcow2_free(struct qcow2_backend *qb) {
+	if (qb->fd >= 0) {
+		close(qb->fd);
+	}
+	if (qb->backing) {
+		qb->backing->close(qb->backing);
+	}
+	for (int i = 0; i < QCOW2_L2_CACHE; i++) {
+		free(qb->l2[i].table);
+	}
+	free(qb->l1);
+	free(qb->rt);
+	free(qb->cow_buf);
+	free(qb->meta_buf);
+	free(qb->gather_buf);
+	free(qb);
+}
+
+static DRESULT
+qcow2_close(struct disk_backend *be) {
+	struct qcow2_backend *qb = (struct qcow2_backend *)be;
+	DRESULT res = qb->rdonly ? RES_OK : qcow2_sync(be);
+
+	qcow2_free(qb);
+	return res;
+}
+
+static uint64_t *
+qcow2_load_table(struct qcow2_backend *qb, uint64_t offset, uint32_t entries) {
+	uint64_t *table = malloc((size_t)entries * 8 + 1);
+	BYTE *raw = malloc((size_t)entries * 8 + 1);
+
+	if (!table || !raw || qcow2_pread(qb, raw, (size_t)entries * 8, offset) != 0) {
+		free(table);
+		free(raw);
+		return NULL;
+	}
+	for (uint32_t i = 0; i < entries; i++) {
+		table[i] = be64(raw + (size_t)i * 8);
+	}
+	free(raw);
+	return table;
+}
+
+/* Open the backing file named in the header, relative to the image itself */
+static int
+qcow2_open_backing(struct qcow2_backend *qb, const char *path, uint64_t name_offset, uint32_t name_len) {
+	char name[4096], full[8192];
+	char *dir_buf;
+
+	if (name_len == 0 || name_len >= sizeof(name) || qcow2_pread(qb, name, name_len, name_offset) != 0) {
+		printf("ERROR: bad qcow2 backing file name\n");
+		return -1;
+	}
+	name[name_len] = '\0';
+
+	dir_buf = strdup(path);
+	if (!dir_buf) {
+		return -1;
+	}
+	if (name[0] == '/') {
+		snprintf(full, sizeof(full), "%s", name);
+	} else {
+		snprintf(full, sizeof(full), "%s/%s", dirname(dir_buf), name);
+	}
+	free(dir_buf);
+
+	qb->backing = qcow2_backend_probe(full) ? qcow2_backend_open(full, 1) : file_backend_open(full, FILE_BACKEND_RDONLY);
+	if (!qb->backing) {
+		printf("ERROR: could not open qcow2 backing file '%s'\n", full);
+		return -1;
+	}
+	return 0;
+}
+
+int
+qcow2_backend_probe(const char *path) {
+	BYTE magic[4];
+	int fd = open(path, O_RDONLY);
+	int ret;
+
+	if (fd < 0) {
+		return 0;
+	}
+	ret = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && be32(magic) == QCOW2_MAGIC;
+	close(fd);
+	return ret;
+}
+
+struct disk_backend *
+qcow2_backend_open(const char *path, int rdonly) {
+	struct qcow2_backend *qb;
+	BYTE hdr[104];
+	uint64_t backing_offset;
+	uint32_t backing_len, snapshots;
+	off_t end;
+	int ok;
+
+	qb = calloc(1, sizeof(*qb));
+	if (!qb) {
+		return NULL;
+	}
+	qb->rdonly = rdonly;
+	qb->fd = open(path, rdonly ? O_RDONLY : O_RDWR);
+	if (qb->fd < 0) {
+		printf("ERROR: could not open image '%s': %s\n", path, strerror(errno));
+		qcow2_free(qb);
+		return NULL;
+	}
+	if (qcow2_pread(qb, hdr, sizeof(hdr), 0) != 0 || be32(hdr) != QCOW2_MAGIC) {
+		printf("ERROR: '%s' is not a qcow2 image\n", path);
+		qcow2_free(qb);
+		return NULL;
+	}
+
+	qb->version = be32(hdr + 4);
+	backing_offset = be64(hdr + 8);
+	backing_len = be32(hdr + 16);
+	qb->cluster_bits = be32(hdr + 20);
+	qb->be.size = be64(hdr + 24);
+	qb->l1_size = be32(hdr + 36);
+	qb->l1_offset = be64(hdr + 40);
+	qb->rt_offset = be64(hdr + 48);
+	snapshots = be32(hdr + 60);
+
+	if ((qb->version != 2 && qb->version != 3) || qb->cluster_bits < 9 || qb->cluster_bits > 21) {
+		printf("ERROR: unsupported qcow2 version %u or cluster size\n", qb->version);
+		qcow2_free(qb);
+		return NULL;
+	}
+	if (be32(hdr + 32) != 0) {
+		printf("ERROR: encrypted qcow2 images are not supported\n");
+		qcow2_free(qb);
+		return NULL;
+	}
+	// v3: incompatible features (dirty, corrupt, external data, ...) and refcount width
+	if (qb->version == 3 && (be64(hdr + 72) != 0 || be32(hdr + 96) != 4)) {
+		printf("ERROR: qcow2 image needs features that are not supported (try qemu-img check -r all)\n");
+		qcow2_free(qb);
+		return NULL;
+	}
+	if (snapshots && !rdonly) {
+		printf("ERROR: writing qcow2 images with internal snapshots is not supported\n");
+		qcow2_free(qb);
+		return NULL;
+	}
+
+	qb->cluster_size = 1u << qb->cluster_bits;
+	qb->l2_entries = qb->cluster_size / 8;
+	qb->rt_entries = (uint64_t)be32(hdr + 56) * qb->cluster_size / 8;
+	qb->l1 = qcow2_load_table(qb, qb->l1_offset, qb->l1_size);
+	qb->rt = qcow2_load_table(qb, qb->rt_offset, qb->rt_entries);
+	qb->cow_buf = malloc(qb->cluster_size);
+	qb->meta_buf = malloc(qb->cluster_size);
+	qb->gather_buf = malloc(qb->cluster_size);
+	ok = qb->l1 && qb->rt && qb->cow_buf && qb->meta_buf && qb->gather_buf;
+	for (int i = 0; i < QCOW2_L2_CACHE; i++) {
+		qb->l2[i].table = malloc((size_t)qb->l2_entries * 8);
+		ok = ok && qb->l2[i].table;
+	}
+	if (!ok) {
+		printf("ERROR: could not load the qcow2 tables of '%s'\n", path);
+		qcow2_free(qb);
+		return NULL;
+	}
+
+	end = lseek(qb->fd, 0, SEEK_END);
+	qb->next_free = ((uint64_t)end + qb->cluster_size - 1) & ~(uint64_t)(qb->cluster_size - 1);
+	qb->autoclear = qb->version == 3 ? be64(hdr + 88) : 0;
+
+	if (backing_offset && qcow2_open_backing(qb, path, backing_offset, backing_len) != 0) {
+		qcow2_free(qb);
+		return NULL;
+	}
+
+	qb->be.name = "qcow2";
+	qb->be.read = qcow2_read;
+	qb->be.write = rdonly ? NULL : qcow2_write;
+	qb->be.writev = rdonly ? NULL : qcow2_writev;
+	qb->be.trim = rdonly ? NULL : qcow2_trim;
+	qb->be.sync = qcow2_sync;
+	qb->be.flush = qcow2_flush;
+	qb->be.close = qcow2_close;
+	return &qb->be;
+}
@@ -0,0 +1,208 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+
+/*
+ * Read-ahead filter in front of another backend. f_read and FAT walks
+ * arrive as a series of small requests; once a request starts where the
+ * previous one ended, the following sectors are fetched along with it and
+ * served from a buffer. The window doubles while the stream continues and
+ * collapses again on the first random access.
+ */
+
+#define RA_MIN_WINDOW	16	// sectors fetched ahead on the first sequential hit
+
+struct readahead_backend {
+	struct disk_backend be;
+	struct disk_backend *lower;
+	BYTE *buf;
+	LBA_t buf_start;
+	UINT buf_count;		// valid sectors in buf
+	UINT max_window;	// capacity of buf in sectors
+	UINT window;		// current read-ahead distance
+	LBA_t next;		// where a sequential reader would continue
+};
+
+static DRESULT
+ra_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct readahead_backend *ra = (struct readahead_backend *)be;
+	LBA_t total = be->size / FATBOY_SECTOR_SIZE;
+	LBA_t buf_end = ra->buf_start + ra->buf_count;
+	UINT fill;
+	DRESULT res;
+
+	// serve whatever the buffer already holds from the front of the request
+	if (ra->buf_count && sector >= ra->buf_start && sector < buf_end) {
+		UINT n = (UINT)(buf_end - sector);
+		if (n > count) {
+			n = count;
+		}
+		memcpy(buff, ra->buf + (size_t)(sector - ra->buf_start) * FATBOY_SECTOR_SIZE,
+				(size_t)n * FATBOY_SECTOR_SIZE);
+		buff += (size_t)n * FATBOY_SECTOR_SIZE;
+		sector += n;
+		count -= n;
+		ra->next = sector;
+		if (count == 0) {
+			return RES_OK;
+		}
+	}
+
+	if (sector == ra->next) {
+		ra->window = ra->window ? ra->window * 2 : RA_MIN_WINDOW;
+		if (ra->window > ra->max_window) {
+			ra->window = ra->max_window;
+		}
+	} else {
+		ra->window = 0;
+	}
+	ra->next = sector + count;
+
+	if (ra->window == 0 || count >= ra->max_window) {
+		return ra->lower->read(ra->lower, buff, sector, count);
+	}
+
+	fill = count + ra->window;
+	if (fill > ra->max_window) {
+		fill = ra->max_window;
+	}
+	if (sector + fill > total) {
+		fill = (UINT)(total - sector);
+	}
+	if (fill <= count) {
+		return ra->lower->read(ra->lower, buff, sector, count);
+	}
+
+	res = ra->lower->read(ra->lower, ra->buf, sector, fill);
+	if (res != RES_OK) {
+		ra->buf_count = 0;
+		return res;
+	}
+	ra->buf_start = sector;
+	ra->buf_count = fill;
+	memcpy(buff, ra->buf, (size_t)count * FATBOY_SECTOR_SIZE);
+	return RES_OK;
+}
+
+static DRESULT
+ra_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct readahead_backend *ra = (struct readahead_backend *)be;
+	LBA_t buf_end = ra->buf_start + ra->buf_count;
+	LBA_t lo, hi;
+	DRESULT res;
+
+	res = ra->lower->write(ra->lower, buff, sector, count);
+	if (res != RES_OK) {
+		ra->buf_count = 0;
+		return res;
+	}
+
+	// keep any prefetched copy of the written sectors current
+	lo = sector > ra->buf_start ? sector : ra->buf_start;
+	hi = sector + count < buf_end ? sector + count : buf_end;
+	if (ra->buf_count && lo < hi) {
+		memcpy(ra->buf + (size_t)(lo - ra->buf_start) * FATBOY_SECTOR_SIZE,
+				buff + (size_t)(lo - sector) * FATBOY_SECTOR_SIZE,
+				(size_t)(hi - lo) * FATBOY_SECTOR_SIZE);
+	}
+	return RES_OK;
+}
+
+static DRESULT
+ra_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct readahead_backend *ra = (struct readahead_backend *)be;
+
+	if (ra->buf_count && sector < ra->buf_start + ra->buf_count && ra->buf_start < sector + count) {
+		ra->buf_count = 0;
+	}
+	if (!ra->lower->trim) {
+		return RES_PARERR;
+	}
+	return ra->lower->trim(ra->lower, sector, count);
+}
+
+static DRESULT
+ra_sync(struct disk_backend *be) {
+	struct readahead_backend *ra = (struct readahead_backend *)be;
+
+	return ra->lower->sync(ra->lower);
+}
+
+static DRESULT
+ra_flush(struct disk_backend *be) {
+	struct readahead_backend *ra = (struct readahead_backend *)be;
+
+	return ra->lower->flush(ra->lower);
+}
+
+static DRESULT
+ra_close(struct disk_backend *be) {
+	struct readahead_backend *ra = (struct readahead_backend *)be;
+	DRESULT res = ra->lower->close(ra->lower);
+
+	free(ra->buf);
+	free(ra);
+	return res;
+}
+
+struct disk_backend *
+readahead_backend_open(struct disk_backend *lower, size_t max_bytes) {
+	struct readahead_backend *ra;
+	UINT max_window = max_bytes / FATBOY_SECTOR_SIZE;
+
+	if (max_window <= RA_MIN_WINDOW) {
+		return lower;
+	}
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra) {
+		return lower;
+	}
+	ra->buf = malloc((size_t)max_window * FATBOY_SECTOR_SIZE);
+	if (!ra->buf) {
+		free(ra);
+		return lower;
+	}
+	ra->lower = lower;
+	ra->max_window = max_window;
+	ra->next = (LBA_t)0 - 1;
+
+	ra->be.name = "readahead";
+	ra->be.size = lower->size;
+	ra->be.sector_size = lower->sector_size;
+	ra->be.block_size = lower->block_size;
+	ra->be.trim_zeroes = lower->trim_zeroes;
+	ra->be.read = ra_read;
+	ra->be.write = lower->write ? ra_write : NULL;
+	ra->be.trim = ra_trim;
+	ra->be.sync = ra_sync;
+	ra->be.flush = lower->flush ? ra_flush : NULL;
+	ra->be.close = ra_close;
+	return &ra->be;
+}
@@ -0,0 +1,680 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+#include "stats.h"
+#include "simg.h"
+
+/*
+ * Android sparse image as a backend. The chunk list is read into an index
+ * at open, reads are served from it: raw chunks from the file, fill and
+ * don't care chunks synthesised. Writes go to an overlay of whole blocks
+ * kept in an unlinked temporary file, trims to a list of extents that
+ * read back as zeros. When the image is closed after changes, a new
+ * sparse image is written next to it with the overlay merged in and
+ * trimmed blocks left as don't care, then renamed over the original.
+ */
+
+#define SIMG_NONE	UINT32_MAX
+#define SIMG_COPY_BLKS	256	// blocks copied per read while rewriting
+
+struct simg_chunk {
+	uint32_t start;		// first block
+	uint32_t count;
+	uint16_t type;
+	uint32_t fill;
+	off_t data;		// raw chunks: file offset of the data
+};
+
+struct simg_extent {
+	uint32_t lo, hi;
+};
+
+struct simg_backend {
+	struct disk_backend be;
+	char *path;
+	int fd;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	struct simg_chunk *chunks;
+	uint32_t n_chunks;
+
+	// overlay of written blocks, block data lives at slot * blk_sz in ovl
+	FILE *ovl;
+	uint32_t *ovl_blk;
+	uint32_t *ovl_next;
+	BYTE *ovl_trimmed;	// slot was trimmed after it was written
+	uint32_t *ovl_hash;
+	uint32_t ovl_mask;
+	uint32_t n_ovl;
+	uint32_t ovl_cap;
+
+	struct simg_extent *trims;	// sorted, disjoint
+	uint32_t n_trims;
+	uint32_t trims_cap;
+
+	int dirty;
+	BYTE *blk_buf;
+	BYTE *zero_buf;		// one block of zeros
+};
+
+static inline uint32_t
+simg_hash(struct simg_backend *sb, uint32_t blk) {
+	return (uint32_t)(((uint64_t)blk * 0x9E3779B97F4A7C15ull) >> 32) & sb->ovl_mask;
+}
+
+static uint32_t
+ovl_lookup(struct simg_backend *sb, uint32_t blk) {
+	uint32_t slot;
+
+	if (!sb->ovl_hash) {
+		return SIMG_NONE;
+	}
+	slot = sb->ovl_hash[simg_hash(sb, blk)];
+	while (slot != SIMG_NONE && sb->ovl_blk[slot] != blk) {
+		slot = sb->ovl_next[slot];
+	}
+	return slot;
+}
+
+static int
+ovl_grow(struct simg_backend *sb) {
+	uint32_t cap = sb->ovl_cap ? sb->ovl_cap * 2 : 1024;
+	uint32_t *blk = realloc(sb->ovl_blk, cap * sizeof(*blk));
+	uint32_t *next, *hash;
+	BYTE *trimmed;
+
+	if (!blk) {
+		return -1;
+	}
+	sb->ovl_blk = blk;
+	next = realloc(sb->ovl_next, cap * sizeof(*next));
+	if (!next) {
+		return -1;
+	}
+	sb->ovl_next = next;
+	trimmed = realloc(sb->ovl_trimmed, cap);
+	if (!trimmed) {
+		return -1;
+	}
+	sb->ovl_trimmed = trimmed;
+	hash = malloc(cap * sizeof(*hash));
+	if (!hash) {
+		return -1;
+	}
+	free(sb->ovl_hash);
+	sb->ovl_hash = hash;
+	sb->ovl_cap = cap;
+	sb->ovl_mask = cap - 1;
+
+	memset(hash, 0xFF, cap * sizeof(*hash));
+	for (uint32_t slot = 0; slot < sb->n_ovl; slot++) {
+		uint32_t h = simg_hash(sb, sb->ovl_blk[slot]);
+		sb->ovl_next[slot] = hash[h];
+		hash[h] = slot;
+	}
+	return 0;
+}
+
+static uint32_t
+ovl_insert(struct simg_backend *sb, uint32_t blk) {
+	uint32_t slot, h;
+
+	if (sb->n_ovl == sb->ovl_cap && ovl_grow(sb) != 0) {
+		printf("ERROR: out of memory for the sparse image overlay\n");
+		return SIMG_NONE;
+	}
+	slot = sb->n_ovl++;
+	h = simg_hash(sb, blk);
+	sb->ovl_blk[slot] = blk;
+	sb->ovl_trimmed[slot] = 0;
+	sb->ovl_next[slot] = sb->ovl_hash[h];
+	sb->ovl_hash[h] = slot;
+	return slot;
+}
+
+static const struct simg_chunk *
+chunk_find(struct simg_backend *sb, uint32_t blk) {
+	uint32_t lo = 0, hi = sb->n_chunks;
+
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (sb->chunks[mid].start <= blk) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return &sb->chunks[lo];
+}
+
+static int
+is_trimmed(struct simg_backend *sb, uint32_t blk) {
+	uint32_t lo = 0, hi = sb->n_trims;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (sb->trims[mid].hi <= blk) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < sb->n_trims && sb->trims[lo].lo <= blk;
+}
+
+static int
+pread_all(int fd, BYTE *buf, size_t len, off_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		io_stats.syscalls++;
+		ssize_t n = pread(fd, buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int
+pwrite_all(int fd, const BYTE *buf, size_t len, off_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		io_stats.syscalls++;
+		ssize_t n = pwrite(fd, buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Read len bytes from offset off of block blk onwards. Raw data that is
+ * not overlaid is read in one go up to the end of its chunk; returns how
+ * many bytes were produced, 0 on error.
+ */
+static size_t
+simg_read_span(struct simg_backend *sb, uint32_t blk, uint32_t off, BYTE *buf, size_t len) {
+	uint32_t slot = ovl_lookup(sb, blk);
+	const struct simg_chunk *c;
+	size_t n = sb->blk_sz - off;
+
+	if (n > len) {
+		n = len;
+	}
+	if (slot != SIMG_NONE) {
+		if (sb->ovl_trimmed[slot]) {
+			memset(buf, 0, n);
+			return n;
+		}
+		return pread_all(fileno(sb->ovl), buf, n, (off_t)slot * sb->blk_sz + off) == 0 ? n : 0;
+	}
+	if (is_trimmed(sb, blk)) {
+		memset(buf, 0, n);
+		return n;
+	}
+
+	c = chunk_find(sb, blk);
+	switch (c->type) {
+		case SIMG_CHUNK_RAW: {
+			uint32_t end = blk + 1;
+			while (n < len && end < c->start + c->count && ovl_lookup(sb, end) == SIMG_NONE && !is_trimmed(sb, end)) {
+				n = len - n > sb->blk_sz ? n + sb->blk_sz : len;
+				end++;
+			}
+			if (pread_all(sb->fd, buf, n, c->data + (off_t)(blk - c->start) * sb->blk_sz + off) != 0) {
+				return 0;
+			}
+			break;
+		}
+		case SIMG_CHUNK_FILL:
+			for (size_t i = 0; i < n; i++) {
+				buf[i] = c->fill >> (8 * ((off + i) % 4));
+			}
+			break;
+		default:
+			memset(buf, 0, n);
+			break;
+	}
+	return n;
+}
+
+static DRESULT
+simg_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct simg_backend *sb = (struct simg_backend *)be;
+	uint64_t pos = (uint64_t)sector * FATBOY_SECTOR_SIZE;
+	size_t len = (size_t)count * FATBOY_SECTOR_SIZE;
+
+	while (len > 0) {
+		size_t n = simg_read_span(sb, pos / sb->blk_sz, pos % sb->blk_sz, buff, len);
+		if (n == 0) {
+			printf("Read of %u sectors at %llu failed: %s\n", count, (unsigned long long)sector, strerror(errno));
+			return RES_ERROR;
+		}
+		buff += n;
+		pos += n;
+		len -= n;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+simg_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct simg_backend *sb = (struct simg_backend *)be;
+	uint64_t pos = (uint64_t)sector * FATBOY_SECTOR_SIZE;
+	size_t len = (size_t)count * FATBOY_SECTOR_SIZE;
+
+	while (len > 0) {
+		uint32_t blk = pos / sb->blk_sz;
+		uint32_t off = pos % sb->blk_sz;
+		size_t n = sb->blk_sz - off < len ? sb->blk_sz - off : len;
+		uint32_t slot = ovl_lookup(sb, blk);
+		const BYTE *src = buff;
+		size_t src_len = n;
+
+		// a block written in part keeps what it held around the new data
+		if (n < sb->blk_sz && (slot == SIMG_NONE || sb->ovl_trimmed[slot])) {
+			if (simg_read_span(sb, blk, 0, sb->blk_buf, sb->blk_sz) != sb->blk_sz) {
+				printf("Read of block %u failed: %s\n", blk, strerror(errno));
+				return RES_ERROR;
+			}
+			memcpy(sb->blk_buf + off, buff, n);
+			src = sb->blk_buf;
+			src_len = sb->blk_sz;
+			off = 0;
+		}
+		if (slot == SIMG_NONE) {
+			slot = ovl_insert(sb, blk);
+			if (slot == SIMG_NONE) {
+				return RES_ERROR;
+			}
+		}
+		if (pwrite_all(fileno(sb->ovl), src, src_len, (off_t)slot * sb->blk_sz + off) != 0) {
+			printf("Write of %u sectors at %llu failed: %s\n", count, (unsigned long long)sector, strerror(errno));
+			return RES_ERROR;
+		}
+		sb->ovl_trimmed[slot] = 0;
+		sb->dirty = 1;
+		buff += n;
+		pos += n;
+		len -= n;
+	}
+	return RES_OK;
+}
+
+/* Zero sectors in [sector, end) that only cover part of a block */
+static DRESULT
+simg_zero(struct simg_backend *sb, LBA_t sector, LBA_t end) {
+	uint32_t spb = sb->blk_sz / FATBOY_SECTOR_SIZE;
+
+	while (sector < end) {
+		UINT n = spb - sector % spb;
+		if (n > end - sector) {
+			n = end - sector;
+		}
+		if (simg_write(&sb->be, sb->zero_buf, sector, n) != RES_OK) {
+			return RES_ERROR;
+		}
+		sector += n;
+	}
+	return RES_OK;
+}
+
+/*
+ * Whole blocks in the range read back as zeros and are left out when
+ * rewriting, the partial blocks at either end are zeroed.
+ */
+static DRESULT
+simg_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct simg_backend *sb = (struct simg_backend *)be;
+	uint32_t spb = sb->blk_sz / FATBOY_SECTOR_SIZE;
+	uint32_t lo = (sector + spb - 1) / spb;
+	uint32_t hi = (sector + count) / spb;
+	uint32_t i, j;
+
+	if (lo >= hi) {
+		return simg_zero(sb, sector, sector + count);
+	}
+	if (simg_zero(sb, sector, (LBA_t)lo * spb) != RES_OK
+			|| simg_zero(sb, (LBA_t)hi * spb, sector + count) != RES_OK) {
+		return RES_ERROR;
+	}
+
+	if (hi - lo < sb->n_ovl) {
+		for (uint32_t blk = lo; blk < hi; blk++) {
+			uint32_t slot = ovl_lookup(sb, blk);
+			if (slot != SIMG_NONE) {
+				sb->ovl_trimmed[slot] = 1;
+			}
+		}
+	} else {
+		for (uint32_t slot = 0; slot < sb->n_ovl; slot++) {
+			if (sb->ovl_blk[slot] >= lo && sb->ovl_blk[slot] < hi) {
+				sb->ovl_trimmed[slot] = 1;
+			}
+		}
+	}
+
+	// merge [lo, hi) into the sorted extent list
+	for (i = 0; i < sb->n_trims && sb->trims[i].hi < lo; i++);
+	for (j = i; j < sb->n_trims && sb->trims[j].lo <= hi; j++) {
+		lo = sb->trims[j].lo < lo ? sb->trims[j].lo : lo;
+		hi = sb->trims[j].hi > hi ? sb->trims[j].hi : hi;
+	}
+	if (i == j) {
+		if (sb->n_trims == sb->trims_cap) {
+			uint32_t cap = sb->trims_cap ? sb->trims_cap * 2 : 64;
+			struct simg_extent *trims = realloc(sb->trims, cap * sizeof(*trims));
+			if (!trims) {
+				return RES_ERROR;
+			}
+			sb->trims = trims;
+			sb->trims_cap = cap;
+		}
+		memmove(&sb->trims[i + 1], &sb->trims[i], (sb->n_trims - i) * sizeof(*sb->trims));
+		sb->n_trims++;
+	} else if (j - i > 1) {
+		memmove(&sb->trims[i + 1], &sb->trims[j], (sb->n_trims - j) * sizeof(*sb->trims));
+		sb->n_trims -= j - i - 1;
+	}
+	sb->trims[i].lo = lo;
+	sb->trims[i].hi = hi;
+	sb->dirty = 1;
+	return RES_OK;
+}
+
+static DRESULT
+simg_sync(struct disk_backend *be) {
+	// changes are kept in the overlay until the image is rewritten on close
+	return RES_OK;
+}
+
+/* Write the current contents as a new sparse image to fd, which is closed */
+static int
+simg_rewrite(struct simg_backend *sb, int fd) {
+	struct simg_writer w;
+	BYTE *buf;
+	int ret = 0;
+
+	buf = malloc((size_t)SIMG_COPY_BLKS * sb->blk_sz);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+	simg_writer_open_fd(&w, fd, sb->blk_sz, sb->total_blks);
+	// it replaces the image, so it has to be on the storage before the rename
+	w.sync = 1;
+
+	for (uint32_t blk = 0; blk < sb->total_blks && ret == 0; ) {
+		uint32_t slot = ovl_lookup(sb, blk);
+		const struct simg_chunk *c;
+		uint32_t n = 1;
+
+		if (slot != SIMG_NONE || is_trimmed(sb, blk)) {
+			if (slot == SIMG_NONE || sb->ovl_trimmed[slot]) {
+				ret = simg_writer_skip(&w, 1);
+			} else if (pread_all(fileno(sb->ovl), buf, sb->blk_sz, (off_t)slot * sb->blk_sz) != 0) {
+				ret = -1;
+			} else {
+				ret = simg_writer_data(&w, buf, 1);
+			}
+			blk++;
+			continue;
+		}
+
+		c = chunk_find(sb, blk);
+		while (n < SIMG_COPY_BLKS && blk + n < c->start + c->count
+				&& ovl_lookup(sb, blk + n) == SIMG_NONE && !is_trimmed(sb, blk + n)) {
+			n++;
+		}
+		if (c->type == SIMG_CHUNK_RAW) {
+			ret = pread_all(sb->fd, buf, (size_t)n * sb->blk_sz, c->data + (off_t)(blk - c->start) * sb->blk_sz);
+			if (ret == 0) {
+				ret = simg_writer_raw(&w, buf, n);
+			}
+		} else if (c->type == SIMG_CHUNK_FILL) {
+			ret = simg_writer_fill(&w, c->fill, n);
+		} else {
+			ret = simg_writer_skip(&w, n);
+		}
+		blk += n;
+	}
+	if (ret != 0) {
+		printf("Error: rewriting sparse image '%s' failed: %s\n", sb->path, strerror(errno));
+	}
+	if (simg_writer_close(&w) != 0) {
+		ret = -1;
+	}
+	free(buf);
+	return ret;
+}
+
+static void
+simg_free(struct simg_backend *sb) {
+	if (sb->fd >= 0) {
+		close(sb->fd);
+	}
+	if (sb->ovl) {
+		fclose(sb->ovl);
+	}
+	free(sb->path);
+	free(sb->chunks);
+	free(sb->ovl_blk);
+	free(sb->ovl_next);
+	free(sb->ovl_trimmed);
+	free(sb->ovl_hash);
+	free(sb->trims);
+	free(sb->blk_buf);
+	free(sb->zero_buf);
+	free(sb);
+}
+
+static DRESULT
+simg_close(struct disk_backend *be) {
+	struct simg_backend *sb = (struct simg_backend *)be;
+	DRESULT res = RES_OK;
+
+	if (sb->dirty) {
+		size_t len = strlen(sb->path) + sizeof(".XXXXXX");
+		char *tmp = malloc(len);
+		struct stat st;
+		int fd = -1;
+
+		res = RES_ERROR;
+		if (tmp) {
+			// a unique name, so no file of the user's is ever replaced or removed
+			snprintf(tmp, len, "%s.XXXXXX", sb->path);
+			fd = mkstemp(tmp);
+		}
+		if (fd < 0) {
+			printf("ERROR: could not create a new copy of '%s', changes are lost: %s\n", sb->path, strerror(errno));
+		} else {
+			if (fstat(sb->fd, &st) == 0) {
+				fchmod(fd, st.st_mode & 07777);
+			}
+			if (simg_rewrite(sb, fd) != 0) {
+				unlink(tmp);
+				printf("ERROR: changes to '%s' could not be saved\n", sb->path);
+			} else if (rename(tmp, sb->path) != 0) {
+				printf("ERROR: could not replace '%s': %s\n", sb->path, strerror(errno));
+				unlink(tmp);
+			} else if (backend_sync_dir(sb->path) == RES_OK) {
+				res = RES_OK;
+			}
+		}
+		free(tmp);
+	}
+	simg_free(sb);
+	return res;
+}
+
+/* Build the chunk index; every block must be covered exactly once */
+static int
+simg_index(struct simg_backend *sb, const BYTE *hdr) {
+	uint32_t file_hdr_sz = simg_le16(hdr + 8);
+	uint32_t chunk_hdr_sz = simg_le16(hdr + 10);
+	uint32_t total_chunks = simg_le32(hdr + 20);
+	off_t pos = file_hdr_sz;
+	uint32_t blk = 0;
+
+	if (simg_le16(hdr + 4) != 1 || file_hdr_sz < SIMG_FILE_HDR_SZ || chunk_hdr_sz < SIMG_CHUNK_HDR_SZ
+			|| sb->blk_sz == 0 || sb->blk_sz % FATBOY_SECTOR_SIZE != 0) {
+		printf("ERROR: unsupported sparse image version or block size\n");
+		return -1;
+	}
+	sb->chunks = calloc(total_chunks ? total_chunks : 1, sizeof(*sb->chunks));
+	if (!sb->chunks) {
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < total_chunks; i++) {
+		BYTE ch[SIMG_CHUNK_HDR_SZ];
+		struct simg_chunk *c = &sb->chunks[sb->n_chunks];
+		uint16_t type;
+		uint32_t count, total;
+
+		if (pread_all(sb->fd, ch, sizeof(ch), pos) != 0) {
+			printf("ERROR: sparse image is truncated at chunk %u\n", i);
+			return -1;
+		}
+		type = simg_le16(ch);
+		count = simg_le32(ch + 4);
+		total = simg_le32(ch + 8);
+		pos += chunk_hdr_sz;
+
+		if (type == SIMG_CHUNK_CRC32) {
+			pos += total - chunk_hdr_sz;
+			continue;
+		}
+		if ((type != SIMG_CHUNK_RAW && type != SIMG_CHUNK_FILL && type != SIMG_CHUNK_DONT_CARE)
+				|| count > sb->total_blks - blk
+				|| (type == SIMG_CHUNK_RAW && total != chunk_hdr_sz + (uint64_t)count * sb->blk_sz)) {
+			printf("ERROR: bad chunk %u in sparse image\n", i);
+			return -1;
+		}
+		c->start = blk;
+		c->count = count;
+		c->type = type;
+		c->data = pos;
+		if (type == SIMG_CHUNK_FILL) {
+			BYTE fill[4];
+			if (pread_all(sb->fd, fill, 4, pos) != 0) {
+				return -1;
+			}
+			c->fill = simg_le32(fill);
+		}
+		pos += total - chunk_hdr_sz;
+		blk += count;
+		if (count) {
+			sb->n_chunks++;
+		}
+	}
+	if (blk != sb->total_blks || sb->n_chunks == 0) {
+		printf("ERROR: sparse image chunks cover %u of %u blocks\n", blk, sb->total_blks);
+		return -1;
+	}
+	return 0;
+}
+
+int
+simg_backend_probe(const char *path) {
+	BYTE magic[4];
+	int fd = open(path, O_RDONLY);
+	int ret;
+
+	if (fd < 0) {
+		return 0;
+	}
+	ret = pread_all(fd, magic, sizeof(magic), 0) == 0 && simg_le32(magic) == SIMG_MAGIC;
+	close(fd);
+	return ret;
+}
+
+struct disk_backend *
+simg_backend_open(const char *path) {
+	struct simg_backend *sb;
+	BYTE hdr[SIMG_FILE_HDR_SZ];
+
+	sb = calloc(1, sizeof(*sb));
+	if (!sb) {
+		return NULL;
+	}
+	sb->path = strdup(path);
+	sb->fd = open(path, O_RDONLY);
+	if (!sb->path || sb->fd < 0) {
+		printf("ERROR: could not open image '%s': %s\n", path, strerror(errno));
+		simg_free(sb);
+		return NULL;
+	}
+	if (pread_all(sb->fd, hdr, sizeof(hdr), 0) != 0 || simg_le32(hdr) != SIMG_MAGIC) {
+		printf("ERROR: '%s' is not a sparse image\n", path);
+		simg_free(sb);
+		return NULL;
+	}
+	sb->blk_sz = simg_le32(hdr + 12);
+	sb->total_blks = simg_le32(hdr + 16);
+	if (simg_index(sb, hdr) != 0) {
+		simg_free(sb);
+		return NULL;
+	}
+
+	sb->ovl = tmpfile();
+	sb->blk_buf = malloc(sb->blk_sz);
+	sb->zero_buf = calloc(1, sb->blk_sz);
+	if (!sb->ovl || !sb->blk_buf || !sb->zero_buf) {
+		printf("ERROR: could not set up the overlay for '%s'\n", path);
+		simg_free(sb);
+		return NULL;
+	}
+
+	sb->be.name = "simg";
+	sb->be.size = (uint64_t)sb->blk_sz * sb->total_blks;
+	sb->be.trim_zeroes = 1;
+	sb->be.read = simg_read;
+	sb->be.write = simg_write;
+	sb->be.trim = simg_trim;
+	sb->be.sync = simg_sync;
+	sb->be.close = simg_close;
+	return &sb->be;
+}
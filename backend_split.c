@@ -0,0 +1,440 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+
+/*
+ * An image stored as several chunk files, in order. Each chunk is opened
+ * as a file backend of its own, so there is one fd per chunk, and I/O is
+ * split at chunk boundaries and passed to the chunks it covers. The chunks
+ * are named either by a pattern with one integer conversion, such as
+ * "disk.img.%03d", numbered from 0 (or 1 if there is no chunk 0), or by
+ * a manifest: a text file starting with SPLIT_MANIFEST_MAGIC followed by
+ * one chunk path per line, relative to the manifest.
+ */
+
+#define SPLIT_MANIFEST_MAGIC	"# fatboy split image"
+#define SPLIT_MAX_CHUNKS	100000
+
+struct split_chunk {
+	struct disk_backend *be;
+	LBA_t start;		// first sector of the chunk in the image
+	LBA_t count;
+};
+
+struct split_backend {
+	struct disk_backend be;
+	struct split_chunk *chunks;
+	int nchunks;
+	int cap;
+};
+
+/* Chunk holding sector, the last one for sectors past the end */
+static struct split_chunk *
+split_find(struct split_backend *sb, LBA_t sector) {
+	int lo = 0, hi = sb->nchunks - 1;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+
+		if (sb->chunks[mid].start <= sector) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return &sb->chunks[lo];
+}
+
+static DRESULT
+split_transfer(struct split_backend *sb, BYTE *buff, LBA_t sector, UINT count, int write) {
+	while (count > 0) {
+		struct split_chunk *c = split_find(sb, sector);
+		LBA_t off = sector - c->start;
+		UINT n;
+		DRESULT res;
+
+		if (off >= c->count) {
+			return RES_PARERR;
+		}
+		n = c->count - off < count ? c->count - off : count;
+		res = write ? c->be->write(c->be, buff, off, n) : c->be->read(c->be, buff, off, n);
+		if (res != RES_OK) {
+			return res;
+		}
+		buff += (size_t)n * FATBOY_SECTOR_SIZE;
+		sector += n;
+		count -= n;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+split_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	return split_transfer((struct split_backend *)be, buff, sector, count, 0);
+}
+
+static DRESULT
+split_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	return split_transfer((struct split_backend *)be, (BYTE *)buff, sector, count, 1);
+}
+
+static DRESULT
+split_writev(struct disk_backend *be, const struct iovec *iov, int iovcnt, LBA_t sector) {
+	struct split_backend *sb = (struct split_backend *)be;
+
+	while (iovcnt > 0) {
+		struct split_chunk *c = split_find(sb, sector);
+		LBA_t end = c->start + c->count;
+		LBA_t next = sector;
+		int n = 0;
+		DRESULT res;
+
+		// hand every buffer that ends inside this chunk over in one go
+		while (n < iovcnt && next + iov[n].iov_len / FATBOY_SECTOR_SIZE <= end) {
+			next += iov[n].iov_len / FATBOY_SECTOR_SIZE;
+			n++;
+		}
+		if (n == 0) {
+			// this buffer straddles the boundary
+			UINT count = iov[0].iov_len / FATBOY_SECTOR_SIZE;
+
+			res = split_write(be, iov[0].iov_base, sector, count);
+			next = sector + count;
+			n = 1;
+		} else if (c->be->writev) {
+			res = c->be->writev(c->be, iov, n, sector - c->start);
+		} else {
+			LBA_t s = sector;
+
+			res = RES_OK;
+			for (int i = 0; i < n && res == RES_OK; i++) {
+				res = c->be->write(c->be, iov[i].iov_base, s - c->start, iov[i].iov_len / FATBOY_SECTOR_SIZE);
+				s += iov[i].iov_len / FATBOY_SECTOR_SIZE;
+			}
+		}
+		if (res != RES_OK) {
+			return res;
+		}
+		iov += n;
+		iovcnt -= n;
+		sector = next;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+split_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct split_backend *sb = (struct split_backend *)be;
+	DRESULT ret = RES_OK;
+
+	while (count > 0) {
+		struct split_chunk *c = split_find(sb, sector);
+		LBA_t off = sector - c->start;
+		LBA_t n;
+		DRESULT res;
+
+		if (off >= c->count) {
+			return RES_PARERR;
+		}
+		n = c->count - off < count ? c->count - off : count;
+		res = c->be->trim ? c->be->trim(c->be, off, n) : RES_PARERR;
+
+		// a chunk that can not trim does not stop the others
+		if (res == RES_ERROR) {
+			return res;
+		}
+		if (res != RES_OK) {
+			ret = res;
+		}
+		sector += n;
+		count -= n;
+	}
+	return ret;
+}
+
+static DRESULT
+split_sync(struct disk_backend *be) {
+	struct split_backend *sb = (struct split_backend *)be;
+	DRESULT ret = RES_OK;
+
+	for (int i = 0; i < sb->nchunks; i++) {
+		DRESULT res = sb->chunks[i].be->sync(sb->chunks[i].be);
+		if (res != RES_OK) {
+			ret = res;
+		}
+	}
+	return ret;
+}
+
+static DRESULT
+split_flush(struct disk_backend *be) {
+	struct split_backend *sb = (struct split_backend *)be;
+	DRESULT ret = RES_OK;
+
+	for (int i = 0; i < sb->nchunks; i++) {
+		DRESULT res = sb->chunks[i].be->flush(sb->chunks[i].be);
+		if (res != RES_OK) {
+			ret = res;
+		}
+	}
+	return ret;
+}
+
+static DRESULT
+split_close(struct disk_backend *be) {
+	struct split_backend *sb = (struct split_backend *)be;
+	DRESULT res = RES_OK;
+
+	for (int i = 0; i < sb->nchunks; i++) {
+		if (sb->chunks[i].be->close(sb->chunks[i].be) != RES_OK) {
+			res = RES_ERROR;
+		}
+	}
+	free(sb->chunks);
+	free(sb);
+	return res;
+}
+
+static int
+split_add(struct split_backend *sb, const char *path, int flags) {
+	struct disk_backend *be;
+
+	if (sb->nchunks == SPLIT_MAX_CHUNKS) {
+		printf("ERROR: more than %d chunks\n", SPLIT_MAX_CHUNKS);
+		return -1;
+	}
+	if (sb->nchunks == sb->cap) {
+		int cap = sb->cap ? sb->cap * 2 : 16;
+		struct split_chunk *chunks = realloc(sb->chunks, cap * sizeof(*chunks));
+
+		if (!chunks) {
+			return -1;
+		}
+		sb->chunks = chunks;
+		sb->cap = cap;
+	}
+	be = file_backend_open(path, flags);
+	if (!be) {
+		return -1;
+	}
+	if (be->size % FATBOY_SECTOR_SIZE != 0 || be->size == 0) {
+		printf("ERROR: chunk '%s' is not a non-zero multiple of 512 bytes\n", path);
+		be->close(be);
+		return -1;
+	}
+	sb->chunks[sb->nchunks].be = be;
+	sb->chunks[sb->nchunks].start = sb->be.size / FATBOY_SECTOR_SIZE;
+	sb->chunks[sb->nchunks].count = be->size / FATBOY_SECTOR_SIZE;
+	sb->nchunks++;
+	sb->be.size += be->size;
+	return 0;
+}
+
+/*
+ * Split a pattern around its one %d, %u or %0Nd conversion. Returns 0 and
+ * fills prefix_len, width and suffix, or -1 if path is not a pattern.
+ */
+static int
+split_pattern(const char *path, size_t *prefix_len, int *width, const char **suffix) {
+	const char *p = strchr(path, '%');
+	const char *q;
+
+	if (!p) {
+		return -1;
+	}
+	q = p + 1;
+	*width = 0;
+	if (*q == '0') {
+		*width = strtol(q, (char **)&q, 10);
+		if (*width > 20) {
+			return -1;
+		}
+	}
+	if (*q != 'd' && *q != 'u') {
+		return -1;
+	}
+	if (strchr(q + 1, '%')) {
+		return -1;
+	}
+	*prefix_len = p - path;
+	*suffix = q + 1;
+	return 0;
+}
+
+static int
+split_chunk_name(char *buf, size_t len, const char *path, unsigned n) {
+	size_t prefix_len;
+	int width;
+	const char *suffix;
+
+	split_pattern(path, &prefix_len, &width, &suffix);
+	return snprintf(buf, len, "%.*s%0*u%s", (int)prefix_len, path, width, n, suffix) < (int)len ? 0 : -1;
+}
+
+static int
+split_is_manifest(const char *path) {
+	char magic[sizeof(SPLIT_MANIFEST_MAGIC) - 1];
+	int fd = open(path, O_RDONLY);
+	int ret;
+
+	if (fd < 0) {
+		return 0;
+	}
+	ret = read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, SPLIT_MANIFEST_MAGIC, sizeof(magic)) == 0;
+	close(fd);
+	return ret;
+}
+
+int
+split_backend_probe(const char *path) {
+	size_t prefix_len;
+	int width;
+	const char *suffix;
+
+	if (split_is_manifest(path)) {
+		return 1;
+	}
+	return access(path, F_OK) != 0 && split_pattern(path, &prefix_len, &width, &suffix) == 0;
+}
+
+static int
+split_open_pattern(struct split_backend *sb, const char *path, int flags) {
+	char name[4096];
+	unsigned first = 0;
+
+	if (split_chunk_name(name, sizeof(name), path, 0) != 0) {
+		return -1;
+	}
+	if (access(name, F_OK) != 0) {
+		first = 1;
+	}
+	for (unsigned n = first; ; n++) {
+		if (split_chunk_name(name, sizeof(name), path, n) != 0) {
+			return -1;
+		}
+		if (access(name, F_OK) != 0) {
+			break;
+		}
+		if (split_add(sb, name, flags) != 0) {
+			return -1;
+		}
+	}
+	if (!sb->nchunks) {
+		printf("ERROR: no chunks match '%s'\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+split_open_manifest(struct split_backend *sb, const char *path, int flags) {
+	char line[4096], name[8192];
+	char *dir_buf = strdup(path);
+	const char *dir;
+	FILE *f = fopen(path, "r");
+	int ret = 0;
+
+	if (!dir_buf || !f) {
+		printf("ERROR: could not read manifest '%s'\n", path);
+		free(dir_buf);
+		if (f) {
+			fclose(f);
+		}
+		return -1;
+	}
+	dir = dirname(dir_buf);
+	while (ret == 0 && fgets(line, sizeof(line), f)) {
+		size_t len = strcspn(line, "\r\n");
+		char *p = line;
+
+		line[len] = '\0';
+		while (isspace((unsigned char)*p)) {
+			p++;
+		}
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+		if (*p == '/') {
+			snprintf(name, sizeof(name), "%s", p);
+		} else {
+			snprintf(name, sizeof(name), "%s/%s", dir, p);
+		}
+		ret = split_add(sb, name, flags);
+	}
+	fclose(f);
+	free(dir_buf);
+	if (ret == 0 && !sb->nchunks) {
+		printf("ERROR: manifest '%s' lists no chunks\n", path);
+		ret = -1;
+	}
+	return ret;
+}
+
+struct disk_backend *
+split_backend_open(const char *path, int flags) {
+	struct split_backend *sb;
+	int ret;
+
+	sb = calloc(1, sizeof(*sb));
+	if (!sb) {
+		return NULL;
+	}
+	ret = split_is_manifest(path) ? split_open_manifest(sb, path, flags) : split_open_pattern(sb, path, flags);
+	if (ret != 0) {
+		split_close(&sb->be);
+		return NULL;
+	}
+
+	// chunks are plain files, block devices or a mix; be as careful as the strictest
+	sb->be.trim_zeroes = 1;
+	for (int i = 0; i < sb->nchunks; i++) {
+		struct disk_backend *c = sb->chunks[i].be;
+
+		if (c->sector_size > sb->be.sector_size) {
+			sb->be.sector_size = c->sector_size;
+		}
+		sb->be.trim_zeroes &= c->trim_zeroes;
+	}
+
+	sb->be.name = "split";
+	sb->be.read = split_read;
+	sb->be.write = split_write;
+	sb->be.writev = split_writev;
+	sb->be.trim = split_trim;
+	sb->be.sync = split_sync;
+	sb->be.flush = split_flush;
+	sb->be.close = split_close;
+	return &sb->be;
+}
@@ -0,0 +1,658 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include "backend.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "elmchan_impl.h"
+#include "stats.h"
+
+/*
+ * io_uring backend. Keeps up to depth requests in flight:
+ *  - writes are copied and submitted without waiting (write-behind), and
+ *    are only waited for on CTRL_SYNC or when a later request overlaps
+ *  - large reads are split into chunks fetched in parallel
+ *  - sequential reads keep a read-ahead window in flight in one of two
+ *    ping-pong buffers while the other one is being consumed
+ * A write-behind failure is remembered and reported by the next write or
+ * sync, since the FatFs call that queued it has already returned.
+ *
+ * The ring is driven with the raw syscalls so there is no liburing
+ * dependency. uring_backend_open() returns NULL when the kernel refuses to
+ * set up a ring, or the image can not be opened, so the caller can fall
+ * back to synchronous I/O.
+ */
+
+#define URING_CHUNK	(64 * 1024)	// bytes per request when splitting large reads
+
+enum uring_op {
+	URING_FREE,
+	URING_READ,
+	URING_WRITE,
+	URING_PREFETCH,
+};
+
+struct uring_req {
+	enum uring_op op;
+	int done;
+	int res;
+	struct iovec iov;
+	off_t offset;
+};
+
+struct uring_prefetch {
+	int slot;		// request in flight, -1 once it has been waited for
+	int valid;		// buffer matches the image
+	LBA_t start;
+	UINT count;
+	BYTE *buf;
+};
+
+struct uring_backend {
+	struct disk_backend be;
+	int fd;
+	int ring_fd;
+	unsigned depth;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned to_submit;
+
+	struct uring_req *reqs;
+	int error;		// sticky write-behind failure
+
+	struct uring_prefetch ra[2];
+	UINT ra_max;		// read-ahead window in sectors, 0 disables it
+	LBA_t next;		// where a sequential reader would continue
+};
+
+static int
+uring_enter(struct uring_backend *ur, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	int ret;
+
+	do {
+		io_stats.syscalls++;
+		ret = (int)syscall(__NR_io_uring_enter, ur->ring_fd, to_submit, min_complete, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+static int
+uring_submit(struct uring_backend *ur) {
+	while (ur->to_submit) {
+		int ret = uring_enter(ur, ur->to_submit, 0, 0);
+		if (ret < 0) {
+			printf("ERROR: io_uring submit failed: %s\n", strerror(errno));
+			return -1;
+		}
+		ur->to_submit -= ret;
+	}
+	return 0;
+}
+
+/* Writes finish here; reads are left for whoever is waiting on them */
+static void
+uring_complete(struct uring_backend *ur, struct uring_req *req, int res) {
+	req->res = res;
+	req->done = 1;
+	if (req->op != URING_WRITE) {
+		return;
+	}
+
+	if (res < 0) {
+		printf("Write of %zu bytes at %lld failed: %s\n", req->iov.iov_len, (long long)req->offset, strerror(-res));
+		ur->error = 1;
+	} else if ((size_t)res < req->iov.iov_len) {
+		// finish a short write synchronously
+		size_t done = res;
+		while (done < req->iov.iov_len) {
+			io_stats.syscalls++;
+			ssize_t n = pwrite(ur->fd, (BYTE *)req->iov.iov_base + done, req->iov.iov_len - done, req->offset + done);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				printf("Write of %zu bytes at %lld failed: %s\n", req->iov.iov_len, (long long)req->offset, strerror(errno));
+				ur->error = 1;
+				break;
+			}
+			done += n;
+		}
+	}
+	free(req->iov.iov_base);
+	req->op = URING_FREE;
+}
+
+static int
+uring_reap(struct uring_backend *ur, int wait) {
+	unsigned head = *ur->cq_head;
+	unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail && wait) {
+		if (uring_submit(ur) != 0 || uring_enter(ur, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+			return -1;
+		}
+		tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+		uring_complete(ur, &ur->reqs[cqe->user_data], cqe->res);
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int
+uring_wait(struct uring_backend *ur, int slot) {
+	while (!ur->reqs[slot].done) {
+		if (uring_reap(ur, 1) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+uring_get_slot(struct uring_backend *ur) {
+	for (;;) {
+		for (unsigned i = 0; i < ur->depth; i++) {
+			if (ur->reqs[i].op == URING_FREE) {
+				return i;
+			}
+		}
+		// every slot is busy, wait for write-behind to retire one
+		if (uring_reap(ur, 1) != 0) {
+			return -1;
+		}
+	}
+}
+
+static void
+uring_queue(struct uring_backend *ur, int slot, enum uring_op op, void *buf, size_t len, off_t offset) {
+	struct uring_req *req = &ur->reqs[slot];
+	unsigned tail = *ur->sq_tail;
+	unsigned idx = tail & *ur->sq_mask;
+	struct io_uring_sqe *sqe = &ur->sqes[idx];
+
+	req->op = op;
+	req->done = 0;
+	req->res = 0;
+	req->iov.iov_base = buf;
+	req->iov.iov_len = len;
+	req->offset = offset;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op == URING_WRITE ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = ur->fd;
+	sqe->off = offset;
+	sqe->addr = (uintptr_t)&req->iov;
+	sqe->len = 1;
+	sqe->user_data = slot;
+
+	ur->sq_array[idx] = idx;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ur->to_submit++;
+}
+
+/* Take back the request queued last, the kernel has not seen it yet */
+static void
+uring_unqueue(struct uring_backend *ur, int slot) {
+	__atomic_store_n(ur->sq_tail, *ur->sq_tail - 1, __ATOMIC_RELEASE);
+	ur->to_submit--;
+	ur->reqs[slot].op = URING_FREE;
+}
+
+/* Wait for in-flight writes touching [offset, offset + len) */
+static int
+uring_wait_writes(struct uring_backend *ur, off_t offset, size_t len) {
+	for (unsigned i = 0; i < ur->depth; i++) {
+		struct uring_req *req = &ur->reqs[i];
+		if (req->op == URING_WRITE && req->offset < offset + (off_t)len
+				&& offset < req->offset + (off_t)req->iov.iov_len) {
+			if (uring_wait(ur, i) != 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+uring_read_done(struct uring_backend *ur, struct uring_req *req) {
+	size_t done = req->res > 0 ? (size_t)req->res : 0;
+
+	if (req->res < 0) {
+		printf("Read of %zu bytes at %lld failed: %s\n", req->iov.iov_len, (long long)req->offset, strerror(-req->res));
+		return -1;
+	}
+	while (done < req->iov.iov_len) {
+		io_stats.syscalls++;
+		ssize_t n = pread(ur->fd, (BYTE *)req->iov.iov_base + done, req->iov.iov_len - done, req->offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			printf("Short read of %zu bytes instead of %zu\n", done, req->iov.iov_len);
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/* Take a prefetch buffer out of flight so it can be read or reused */
+static int
+uring_settle(struct uring_backend *ur, struct uring_prefetch *ra) {
+	int ret = 0;
+
+	if (ra->slot >= 0) {
+		struct uring_req *req = &ur->reqs[ra->slot];
+		ret = uring_wait(ur, ra->slot);
+		if (ret == 0 && uring_read_done(ur, req) != 0) {
+			ra->valid = 0;
+		}
+		req->op = URING_FREE;
+		ra->slot = -1;
+	}
+	return ret;
+}
+
+static void
+uring_prefetch(struct uring_backend *ur, struct uring_prefetch *ra, LBA_t start) {
+	LBA_t total = ur->be.size / FATBOY_SECTOR_SIZE;
+	int slot;
+
+	if (start >= total || uring_settle(ur, ra) != 0) {
+		return;
+	}
+	ra->count = total - start < ur->ra_max ? (UINT)(total - start) : ur->ra_max;
+	if (uring_wait_writes(ur, (off_t)start * FATBOY_SECTOR_SIZE, (size_t)ra->count * FATBOY_SECTOR_SIZE) != 0) {
+		ra->valid = 0;
+		return;
+	}
+	slot = uring_get_slot(ur);
+	if (slot < 0) {
+		return;
+	}
+
+	ra->start = start;
+	ra->valid = 1;
+	ra->slot = slot;
+	uring_queue(ur, slot, URING_PREFETCH, ra->buf, (size_t)ra->count * FATBOY_SECTOR_SIZE,
+			(off_t)start * FATBOY_SECTOR_SIZE);
+	uring_submit(ur);
+}
+
+static int
+uring_prefetch_hit(struct uring_backend *ur, BYTE *buff, LBA_t sector, UINT count) {
+	for (int i = 0; i < 2; i++) {
+		struct uring_prefetch *ra = &ur->ra[i];
+		struct uring_prefetch *other = &ur->ra[!i];
+
+		if (!ra->valid || sector < ra->start || sector + count > ra->start + ra->count) {
+			continue;
+		}
+		if (uring_settle(ur, ra) != 0 || !ra->valid) {
+			return 0;
+		}
+		memcpy(buff, ra->buf + (size_t)(sector - ra->start) * FATBOY_SECTOR_SIZE, (size_t)count * FATBOY_SECTOR_SIZE);
+
+		// keep the next window in flight while this one is consumed
+		if (!other->valid || other->start != ra->start + ra->count) {
+			uring_prefetch(ur, other, ra->start + ra->count);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static DRESULT
+uring_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct uring_backend *ur = (struct uring_backend *)be;
+	size_t len = (size_t)count * FATBOY_SECTOR_SIZE;
+	off_t offset = (off_t)sector * FATBOY_SECTOR_SIZE;
+	int slots[64];
+	int n_slots = 0;
+	int sequential = sector == ur->next;
+	DRESULT res = RES_OK;
+
+	ur->next = sector + count;
+
+	if (uring_wait_writes(ur, (off_t)offset, (size_t)len) != 0) {
+		return RES_ERROR;
+	}
+
+	if (ur->ra_max && uring_prefetch_hit(ur, buff, sector, count)) {
+		return RES_OK;
+	}
+
+	// contiguous runs are fetched as several parallel requests
+	for (size_t done = 0; done < len; ) {
+		size_t chunk = len - done;
+		if (chunk > URING_CHUNK && n_slots < (int)(sizeof(slots) / sizeof(slots[0])) - 1
+				&& (unsigned)n_slots < ur->depth / 2) {
+			chunk = URING_CHUNK;
+		}
+		int slot = uring_get_slot(ur);
+		if (slot < 0) {
+			// what is already queued still targets buff, let it land first
+			res = RES_ERROR;
+			break;
+		}
+		uring_queue(ur, slot, URING_READ, buff + done, chunk, offset + done);
+		slots[n_slots++] = slot;
+		done += chunk;
+	}
+	if (uring_submit(ur) != 0) {
+		res = RES_ERROR;
+	}
+	for (int i = 0; i < n_slots; i++) {
+		if (uring_wait(ur, slots[i]) != 0 || uring_read_done(ur, &ur->reqs[slots[i]]) != 0) {
+			res = RES_ERROR;
+		}
+		ur->reqs[slots[i]].op = URING_FREE;
+	}
+
+	if (res == RES_OK && sequential && ur->ra_max) {
+		uring_prefetch(ur, &ur->ra[0], sector + count);
+	}
+	return res;
+}
+
+static DRESULT
+uring_write(struct disk_backend *be, const BYTE *buff, LBA_t sector, UINT count) {
+	struct uring_backend *ur = (struct uring_backend *)be;
+	size_t len = (size_t)count * FATBOY_SECTOR_SIZE;
+	off_t offset = (off_t)sector * FATBOY_SECTOR_SIZE;
+	BYTE *copy;
+	int slot;
+
+	if (ur->error) {
+		return RES_ERROR;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		struct uring_prefetch *ra = &ur->ra[i];
+		if (ra->valid && sector < ra->start + ra->count && ra->start < sector + count) {
+			ra->valid = 0;
+		}
+	}
+
+	// requests to the same range may complete in any order, keep them serial
+	if (uring_wait_writes(ur, offset, len) != 0) {
+		return RES_ERROR;
+	}
+
+	copy = malloc(len);
+	if (!copy) {
+		return RES_ERROR;
+	}
+	memcpy(copy, buff, len);
+
+	slot = uring_get_slot(ur);
+	if (slot < 0) {
+		free(copy);
+		return RES_ERROR;
+	}
+	uring_queue(ur, slot, URING_WRITE, copy, len, offset);
+	if (uring_submit(ur) != 0) {
+		// requests go to the kernel in order, so this one is still unsubmitted
+		uring_unqueue(ur, slot);
+		free(copy);
+		return RES_ERROR;
+	}
+	uring_reap(ur, 0);
+	return RES_OK;
+}
+
+static DRESULT
+uring_drain_writes(struct uring_backend *ur) {
+	for (unsigned i = 0; i < ur->depth; i++) {
+		if (ur->reqs[i].op == URING_WRITE && uring_wait(ur, i) != 0) {
+			return RES_ERROR;
+		}
+	}
+	return RES_OK;
+}
+
+static DRESULT
+uring_trim(struct disk_backend *be, LBA_t sector, LBA_t count) {
+	struct uring_backend *ur = (struct uring_backend *)be;
+	uint64_t offset = (uint64_t)sector * FATBOY_SECTOR_SIZE;
+	uint64_t len = (uint64_t)count * FATBOY_SECTOR_SIZE;
+
+	// a write still in flight must not land after the hole is punched
+	if (uring_wait_writes(ur, offset, len) != 0) {
+		return RES_ERROR;
+	}
+	for (int i = 0; i < 2; i++) {
+		struct uring_prefetch *ra = &ur->ra[i];
+		if (ra->valid && sector < ra->start + ra->count && ra->start < sector + count) {
+			uring_settle(ur, ra);
+			ra->valid = 0;
+		}
+	}
+	return backend_discard(ur->fd, be, offset, len);
+}
+
+static DRESULT
+uring_sync(struct disk_backend *be) {
+	struct uring_backend *ur = (struct uring_backend *)be;
+	DRESULT res;
+
+	res = uring_drain_writes(ur);
+	if (ur->error) {
+		ur->error = 0;
+		res = RES_ERROR;
+	}
+	return res;
+}
+
+static DRESULT
+uring_flush(struct disk_backend *be) {
+	struct uring_backend *ur = (struct uring_backend *)be;
+	DRESULT res = uring_sync(be);
+
+	return res == RES_OK ? backend_flush_fd(ur->fd) : res;
+}
+
+static void
+uring_free(struct uring_backend *ur) {
+	if (ur->sqes && ur->sqes != MAP_FAILED) {
+		munmap(ur->sqes, ur->sqes_len);
+	}
+	if (ur->cq_ptr && ur->cq_ptr != MAP_FAILED && ur->cq_ptr != ur->sq_ptr) {
+		munmap(ur->cq_ptr, ur->cq_len);
+	}
+	if (ur->sq_ptr && ur->sq_ptr != MAP_FAILED) {
+		munmap(ur->sq_ptr, ur->sq_len);
+	}
+	if (ur->ring_fd >= 0) {
+		close(ur->ring_fd);
+	}
+	if (ur->fd >= 0) {
+		close(ur->fd);
+	}
+	free(ur->ra[0].buf);
+	free(ur->ra[1].buf);
+	free(ur->reqs);
+	free(ur);
+}
+
+static DRESULT
+uring_close(struct disk_backend *be) {
+	struct uring_backend *ur = (struct uring_backend *)be;
+	DRESULT res;
+
+	uring_settle(ur, &ur->ra[0]);
+	uring_settle(ur, &ur->ra[1]);
+	res = uring_sync(be);
+	uring_free(ur);
+	return res;
+}
+
+static int
+uring_setup(struct uring_backend *ur) {
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	ur->ring_fd = (int)syscall(__NR_io_uring_setup, ur->depth, &p);
+	if (ur->ring_fd < 0) {
+		return -1;
+	}
+
+	ur->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_len > ur->sq_len) {
+			ur->sq_len = ur->cq_len;
+		}
+		ur->cq_len = ur->sq_len;
+	}
+
+	ur->sq_ptr = mmap(NULL, ur->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur->ring_fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ptr == MAP_FAILED) {
+		return -1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ptr = ur->sq_ptr;
+	} else {
+		ur->cq_ptr = mmap(NULL, ur->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ur->ring_fd, IORING_OFF_CQ_RING);
+		if (ur->cq_ptr == MAP_FAILED) {
+			return -1;
+		}
+	}
+	ur->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur->ring_fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		return -1;
+	}
+
+	ur->sq_head = (unsigned *)((BYTE *)ur->sq_ptr + p.sq_off.head);
+	ur->sq_tail = (unsigned *)((BYTE *)ur->sq_ptr + p.sq_off.tail);
+	ur->sq_mask = (unsigned *)((BYTE *)ur->sq_ptr + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned *)((BYTE *)ur->sq_ptr + p.sq_off.array);
+	ur->cq_head = (unsigned *)((BYTE *)ur->cq_ptr + p.cq_off.head);
+	ur->cq_tail = (unsigned *)((BYTE *)ur->cq_ptr + p.cq_off.tail);
+	ur->cq_mask = (unsigned *)((BYTE *)ur->cq_ptr + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)((BYTE *)ur->cq_ptr + p.cq_off.cqes);
+
+	// the kernel may round the ring up, never keep more than it holds in flight
+	if (ur->depth > p.sq_entries) {
+		ur->depth = p.sq_entries;
+	}
+	return 0;
+}
+
+struct disk_backend *
+uring_backend_open(const char *path, unsigned depth, size_t readahead_bytes) {
+	struct uring_backend *ur;
+
+	ur = calloc(1, sizeof(*ur));
+	if (!ur) {
+		return NULL;
+	}
+	ur->fd = -1;
+	ur->ring_fd = -1;
+	ur->depth = depth ? depth : 1;
+	ur->ra[0].slot = ur->ra[1].slot = -1;
+
+	if (uring_setup(ur) != 0) {
+		printf("io_uring unavailable (%s), using synchronous I/O\n", strerror(errno));
+		uring_free(ur);
+		return NULL;
+	}
+
+	ur->reqs = calloc(ur->depth, sizeof(*ur->reqs));
+	if (!ur->reqs) {
+		uring_free(ur);
+		return NULL;
+	}
+
+	ur->ra_max = readahead_bytes / FATBOY_SECTOR_SIZE;
+	// two windows plus a split read must fit in the queue
+	if (ur->ra_max && ur->depth >= 8) {
+		ur->ra[0].buf = malloc((size_t)ur->ra_max * FATBOY_SECTOR_SIZE);
+		ur->ra[1].buf = malloc((size_t)ur->ra_max * FATBOY_SECTOR_SIZE);
+	}
+	if (!ur->ra[0].buf || !ur->ra[1].buf) {
+		ur->ra_max = 0;
+	}
+	ur->next = (LBA_t)0 - 1;
+
+	// open errors are left for the synchronous fallback to report
+	ur->fd = open(path, O_RDWR);
+	if (ur->fd < 0 || backend_probe(ur->fd, path, &ur->be) != 0) {
+		uring_free(ur);
+		return NULL;
+	}
+
+	ur->be.name = "io_uring";
+	ur->be.read = uring_read;
+	ur->be.write = uring_write;
+	ur->be.trim = uring_trim;
+	ur->be.sync = uring_sync;
+	ur->be.flush = uring_flush;
+	ur->be.close = uring_close;
+	return &ur->be;
+}
+
+#else
+
+struct disk_backend *
+uring_backend_open(const char *path, unsigned depth, size_t readahead_bytes) {
+	printf("io_uring is not supported on this platform, using synchronous I/O\n");
+	return NULL;
+}
+
+#endif
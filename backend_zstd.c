@@ -0,0 +1,338 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "backend.h"
+#include "elmchan_impl.h"
+#include "stats.h"
+
+/*
+ * Read-only images in the zstd seekable format: a series of independent
+ * zstd frames followed by a skippable frame holding a seek table with the
+ * compressed and decompressed size of each frame. Only the frames a read
+ * touches are decompressed, and an LRU set of them is kept so directory
+ * walks and neighbouring reads do not decompress the same frame again.
+ */
+
+#define ZSTD_SEEKABLE_MAGIC	0x8F92EAB1
+#define ZSTD_SKIPPABLE_MAGIC	0x184D2A5E
+#define ZSTD_SEEK_FOOTER	9		// frame count, descriptor, magic
+#define ZSTD_SEEK_CHECKSUM	0x80		// descriptor: entries carry a checksum
+#define ZSTD_CACHE_BYTES	(32 << 20)	// decompressed frames kept in memory
+#define ZSTD_CACHE_MIN		4		// frames kept even if they are large
+
+static uint32_t
+le32(const BYTE *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Number of frames if the file ends in a seekable format seek table, else 0 */
+static uint32_t
+zstd_footer(int fd, off_t *table_start, int *entry_size) {
+	BYTE footer[ZSTD_SEEK_FOOTER], hdr[8];
+	off_t end = lseek(fd, 0, SEEK_END);
+	uint32_t frames;
+
+	if (end < ZSTD_SEEK_FOOTER + 8 || pread(fd, footer, sizeof(footer), end - sizeof(footer)) != sizeof(footer)
+			|| le32(footer + 5) != ZSTD_SEEKABLE_MAGIC || (footer[4] & 0x7C)) {
+		return 0;
+	}
+	frames = le32(footer);
+	*entry_size = footer[4] & ZSTD_SEEK_CHECKSUM ? 12 : 8;
+	*table_start = end - ZSTD_SEEK_FOOTER - (off_t)frames * *entry_size;
+	if (*table_start < 8 || pread(fd, hdr, sizeof(hdr), *table_start - 8) != sizeof(hdr)
+			|| le32(hdr) != ZSTD_SKIPPABLE_MAGIC
+			|| le32(hdr + 4) != (uint64_t)frames * *entry_size + ZSTD_SEEK_FOOTER) {
+		return 0;
+	}
+	return frames;
+}
+
+int
+zstd_backend_probe(const char *path) {
+	off_t table_start;
+	int entry_size;
+	int fd = open(path, O_RDONLY);
+	int ret;
+
+	if (fd < 0) {
+		return 0;
+	}
+	ret = zstd_footer(fd, &table_start, &entry_size) > 0;
+	close(fd);
+	return ret;
+}
+
+#ifdef HAVE_ZSTD
+
+#include <zstd.h>
+
+struct zstd_frame {
+	uint64_t c_offset;	// of the compressed frame in the file
+	uint64_t d_offset;	// of its contents in the image
+	uint32_t c_size;
+	uint32_t d_size;
+};
+
+struct zstd_slot {
+	uint32_t frame;
+	BYTE *buf;		// NULL while the slot is unused
+	uint64_t last_use;
+};
+
+struct zstd_backend {
+	struct disk_backend be;
+	int fd;
+	ZSTD_DCtx *dctx;
+	struct zstd_frame *frames;
+	uint32_t nframes;
+	struct zstd_slot *slots;
+	int nslots;
+	uint64_t clock;
+	BYTE *cbuf;		// compressed frame being decompressed
+	uint32_t max_c_size;
+	uint32_t max_d_size;
+};
+
+/* Index of the frame holding image offset pos */
+static uint32_t
+zstd_find_frame(const struct zstd_backend *zb, uint64_t pos) {
+	uint32_t lo = 0, hi = zb->nframes - 1;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo + 1) / 2;
+
+		if (zb->frames[mid].d_offset <= pos) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+/* Decompressed contents of frame f, from the cache or freshly decompressed */
+static const BYTE *
+zstd_get_frame(struct zstd_backend *zb, uint32_t f) {
+	const struct zstd_frame *fr = &zb->frames[f];
+	struct zstd_slot *slot = &zb->slots[0];
+	size_t done = 0, n;
+
+	for (int i = 0; i < zb->nslots; i++) {
+		if (zb->slots[i].buf && zb->slots[i].frame == f) {
+			zb->slots[i].last_use = ++zb->clock;
+			return zb->slots[i].buf;
+		}
+		if (zb->slots[i].last_use < slot->last_use) {
+			slot = &zb->slots[i];
+		}
+	}
+
+	while (done < fr->c_size) {
+		io_stats.syscalls++;
+		ssize_t r = pread(zb->fd, zb->cbuf + done, fr->c_size - done, fr->c_offset + done);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			printf("zstd read of frame %u failed: %s\n", f, r ? strerror(errno) : "short file");
+			return NULL;
+		}
+		done += r;
+	}
+
+	if (!slot->buf) {
+		slot->buf = malloc(zb->max_d_size ? zb->max_d_size : 1);
+		if (!slot->buf) {
+			return NULL;
+		}
+	}
+	n = ZSTD_decompressDCtx(zb->dctx, slot->buf, zb->max_d_size, zb->cbuf, fr->c_size);
+	if (ZSTD_isError(n) || n != fr->d_size) {
+		printf("ERROR: zstd frame %u is corrupt: %s\n", f, ZSTD_isError(n) ? ZSTD_getErrorName(n) : "wrong size");
+		free(slot->buf);
+		slot->buf = NULL;
+		slot->last_use = 0;
+		return NULL;
+	}
+	slot->frame = f;
+	slot->last_use = ++zb->clock;
+	return slot->buf;
+}
+
+static DRESULT
+zstd_read(struct disk_backend *be, BYTE *buff, LBA_t sector, UINT count) {
+	struct zstd_backend *zb = (struct zstd_backend *)be;
+	uint64_t pos = (uint64_t)sector * FATBOY_SECTOR_SIZE;
+	size_t len = (size_t)count * FATBOY_SECTOR_SIZE;
+
+	if (pos + len > be->size) {
+		return RES_PARERR;
+	}
+	while (len > 0) {
+		uint32_t f = zstd_find_frame(zb, pos);
+		const struct zstd_frame *fr = &zb->frames[f];
+		uint64_t off = pos - fr->d_offset;
+		size_t n = fr->d_size - off < len ? fr->d_size - off : len;
+		const BYTE *data = zstd_get_frame(zb, f);
+
+		if (!data) {
+			return RES_ERROR;
+		}
+		memcpy(buff, data + off, n);
+		buff += n;
+		pos += n;
+		len -= n;
+	}
+	return RES_OK;
+}
+
+static DRESULT
+zstd_sync(struct disk_backend *be) {
+	// never written
+	return RES_OK;
+}
+
+static void
+zstd_free(struct zstd_backend *zb) {
+	if (zb->fd >= 0) {
+		close(zb->fd);
+	}
+	for (int i = 0; i < zb->nslots; i++) {
+		free(zb->slots[i].buf);
+	}
+	ZSTD_freeDCtx(zb->dctx);
+	free(zb->slots);
+	free(zb->frames);
+	free(zb->cbuf);
+	free(zb);
+}
+
+static DRESULT
+zstd_close(struct disk_backend *be) {
+	zstd_free((struct zstd_backend *)be);
+	return RES_OK;
+}
+
+/* Load the seek table and turn it into absolute offsets */
+static int
+zstd_load_index(struct zstd_backend *zb) {
+	off_t table_start;
+	int entry_size;
+	uint64_t c_offset = 0, d_offset = 0;
+	BYTE *table;
+
+	zb->nframes = zstd_footer(zb->fd, &table_start, &entry_size);
+	if (!zb->nframes) {
+		return -1;
+	}
+	table = malloc((size_t)zb->nframes * entry_size);
+	zb->frames = calloc(zb->nframes, sizeof(*zb->frames));
+	if (!table || !zb->frames
+			|| pread(zb->fd, table, (size_t)zb->nframes * entry_size, table_start) != (ssize_t)zb->nframes * entry_size) {
+		free(table);
+		return -1;
+	}
+	for (uint32_t i = 0; i < zb->nframes; i++) {
+		struct zstd_frame *fr = &zb->frames[i];
+
+		fr->c_offset = c_offset;
+		fr->d_offset = d_offset;
+		fr->c_size = le32(table + (size_t)i * entry_size);
+		fr->d_size = le32(table + (size_t)i * entry_size + 4);
+		c_offset += fr->c_size;
+		d_offset += fr->d_size;
+		if (fr->c_size > zb->max_c_size) {
+			zb->max_c_size = fr->c_size;
+		}
+		if (fr->d_size > zb->max_d_size) {
+			zb->max_d_size = fr->d_size;
+		}
+	}
+	free(table);
+	if (c_offset > (uint64_t)table_start - 8) {
+		return -1;
+	}
+	zb->be.size = d_offset;
+	return 0;
+}
+
+struct disk_backend *
+zstd_backend_open(const char *path) {
+	struct zstd_backend *zb;
+
+	zb = calloc(1, sizeof(*zb));
+	if (!zb) {
+		return NULL;
+	}
+	zb->fd = open(path, O_RDONLY);
+	if (zb->fd < 0) {
+		printf("ERROR: could not open image '%s': %s\n", path, strerror(errno));
+		zstd_free(zb);
+		return NULL;
+	}
+	if (zstd_load_index(zb) != 0) {
+		printf("ERROR: '%s' has a bad zstd seek table\n", path);
+		zstd_free(zb);
+		return NULL;
+	}
+
+	zb->nslots = zb->max_d_size ? ZSTD_CACHE_BYTES / zb->max_d_size : ZSTD_CACHE_MIN;
+	if (zb->nslots < ZSTD_CACHE_MIN) {
+		zb->nslots = ZSTD_CACHE_MIN;
+	}
+	if ((uint32_t)zb->nslots > zb->nframes) {
+		zb->nslots = zb->nframes;
+	}
+	zb->slots = calloc(zb->nslots, sizeof(*zb->slots));
+	zb->cbuf = malloc(zb->max_c_size ? zb->max_c_size : 1);
+	zb->dctx = ZSTD_createDCtx();
+	if (!zb->slots || !zb->cbuf || !zb->dctx) {
+		zstd_free(zb);
+		return NULL;
+	}
+
+	// no write op: the image is reported write protected
+	zb->be.name = "zstd";
+	zb->be.read = zstd_read;
+	zb->be.sync = zstd_sync;
+	zb->be.close = zstd_close;
+	return &zb->be;
+}
+
+#else
+
+struct disk_backend *
+zstd_backend_open(const char *path) {
+	printf("ERROR: '%s' is zstd compressed and fatboy was built without libzstd\n", path);
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,460 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "elmchan_impl.h"
+
+/*
+ * Write-back LRU cache of image sectors sitting between disk_read/disk_write
+ * and the backend. FatFs funnels every FAT and directory access through a
+ * single sector window, so keeping recently used sectors around saves most
+ * of the re-reads and write-backs that window thrashing would cause.
+ *
+ * Dirty sectors are written back when evicted or on cache_sync(), which
+ * diskio.c calls for CTRL_SYNC. Requests larger than CACHE_BYPASS_DIV of the
+ * cache go straight to the backend so bulk file data does not flush out the
+ * metadata; cached copies in their range are kept coherent.
+ */
+
+#define CACHE_NONE		UINT32_MAX
+#define CACHE_BYPASS_DIV	8
+#define CACHE_FLUSH_RUN		128	// sectors per write during cache_sync
+
+struct cache_entry {
+	LBA_t sector;
+	uint32_t hash_next;
+	uint32_t lru_prev;
+	uint32_t lru_next;
+	uint8_t valid;
+	uint8_t dirty;
+};
+
+static struct cache_entry *entries = NULL;
+static BYTE *blocks = NULL;
+static uint32_t *hash = NULL;
+static uint32_t n_entries = 0;
+static UINT sector_size = FATBOY_SECTOR_SIZE;	// file system sector size, set by cache_init
+static uint32_t hash_mask = 0;
+static uint32_t lru_head = CACHE_NONE;	// most recently used
+static uint32_t lru_tail = CACHE_NONE;	// eviction candidate
+static struct cache_stats stats;
+
+static inline uint32_t
+cache_hash(LBA_t sector) {
+	uint64_t h = (uint64_t)sector * 0x9E3779B97F4A7C15ull;
+	return (uint32_t)(h >> 32) & hash_mask;
+}
+
+static inline BYTE *
+cache_block(uint32_t idx) {
+	return blocks + (size_t)idx * sector_size;
+}
+
+static void
+lru_unlink(uint32_t idx) {
+	struct cache_entry *e = &entries[idx];
+
+	if (e->lru_prev != CACHE_NONE) {
+		entries[e->lru_prev].lru_next = e->lru_next;
+	} else {
+		lru_head = e->lru_next;
+	}
+	if (e->lru_next != CACHE_NONE) {
+		entries[e->lru_next].lru_prev = e->lru_prev;
+	} else {
+		lru_tail = e->lru_prev;
+	}
+}
+
+static void
+lru_push_head(uint32_t idx) {
+	struct cache_entry *e = &entries[idx];
+
+	e->lru_prev = CACHE_NONE;
+	e->lru_next = lru_head;
+	if (lru_head != CACHE_NONE) {
+		entries[lru_head].lru_prev = idx;
+	}
+	lru_head = idx;
+	if (lru_tail == CACHE_NONE) {
+		lru_tail = idx;
+	}
+}
+
+static void
+lru_push_tail(uint32_t idx) {
+	struct cache_entry *e = &entries[idx];
+
+	e->lru_next = CACHE_NONE;
+	e->lru_prev = lru_tail;
+	if (lru_tail != CACHE_NONE) {
+		entries[lru_tail].lru_next = idx;
+	}
+	lru_tail = idx;
+	if (lru_head == CACHE_NONE) {
+		lru_head = idx;
+	}
+}
+
+static void
+lru_touch(uint32_t idx) {
+	if (lru_head != idx) {
+		lru_unlink(idx);
+		lru_push_head(idx);
+	}
+}
+
+static uint32_t
+cache_lookup(LBA_t sector) {
+	uint32_t idx = hash[cache_hash(sector)];
+
+	while (idx != CACHE_NONE && entries[idx].sector != sector) {
+		idx = entries[idx].hash_next;
+	}
+	return idx;
+}
+
+static void
+hash_remove(uint32_t idx) {
+	uint32_t *link = &hash[cache_hash(entries[idx].sector)];
+
+	while (*link != idx) {
+		link = &entries[*link].hash_next;
+	}
+	*link = entries[idx].hash_next;
+}
+
+static DRESULT
+cache_writeback(uint32_t idx) {
+	DRESULT res = RAM_disk_write(cache_block(idx), entries[idx].sector, 1);
+
+	if (res == RES_OK) {
+		entries[idx].dirty = 0;
+		stats.writebacks++;
+	}
+	return res;
+}
+
+/* Find a slot for sector, evicting the least recently used entry if needed */
+static DRESULT
+cache_insert(LBA_t sector, uint32_t *out) {
+	uint32_t idx = lru_tail;
+	struct cache_entry *e = &entries[idx];
+
+	if (e->valid) {
+		if (e->dirty) {
+			DRESULT res = cache_writeback(idx);
+			if (res != RES_OK) {
+				return res;
+			}
+		}
+		hash_remove(idx);
+		stats.evictions++;
+	}
+
+	e->sector = sector;
+	e->valid = 1;
+	e->dirty = 0;
+	e->hash_next = hash[cache_hash(sector)];
+	hash[cache_hash(sector)] = idx;
+	lru_touch(idx);
+
+	*out = idx;
+	return RES_OK;
+}
+
+static int
+cache_bypass(UINT count) {
+	return count > n_entries / CACHE_BYPASS_DIV;
+}
+
+int
+cache_init(size_t bytes, UINT ssize) {
+	uint32_t hash_size = 1;
+
+	cache_shutdown();
+	sector_size = ssize;
+	memset(&stats, 0, sizeof(stats));
+
+	if (bytes / sector_size >= CACHE_NONE) {
+		bytes = (size_t)(CACHE_NONE - 1) * sector_size;
+	}
+	n_entries = bytes / sector_size;
+	if (n_entries == 0) {
+		return 0;
+	}
+
+	while (hash_size < n_entries && hash_size < (1u << 31)) {
+		hash_size <<= 1;
+	}
+
+	entries = calloc(n_entries, sizeof(*entries));
+	blocks = malloc((size_t)n_entries * sector_size);
+	hash = malloc(hash_size * sizeof(*hash));
+	if (!entries || !blocks || !hash) {
+		printf("ERROR: could not allocate a %zu byte sector cache\n", bytes);
+		cache_shutdown();
+		return -1;
+	}
+	hash_mask = hash_size - 1;
+	memset(hash, 0xFF, hash_size * sizeof(*hash));
+
+	lru_head = lru_tail = CACHE_NONE;
+	for (uint32_t i = 0; i < n_entries; i++) {
+		lru_push_head(i);
+	}
+	return 0;
+}
+
+DRESULT
+cache_shutdown(void) {
+	DRESULT res = RES_OK;
+
+	if (entries) {
+		res = cache_sync();
+	}
+	free(entries);
+	free(blocks);
+	free(hash);
+	entries = NULL;
+	blocks = NULL;
+	hash = NULL;
+	n_entries = 0;
+	lru_head = lru_tail = CACHE_NONE;
+	return res;
+}
+
+int
+cache_enabled(void) {
+	return n_entries != 0;
+}
+
+DRESULT
+cache_read(BYTE *buff, LBA_t sector, UINT count) {
+	DRESULT res;
+	UINT i, run;
+
+	if (!cache_enabled()) {
+		return RAM_disk_read(buff, sector, count);
+	}
+
+	if (cache_bypass(count)) {
+		res = RAM_disk_read(buff, sector, count);
+		if (res != RES_OK) {
+			return res;
+		}
+		// cached copies may be newer than the backend
+		for (i = 0; i < count; i++) {
+			uint32_t idx = cache_lookup(sector + i);
+			if (idx != CACHE_NONE && entries[idx].dirty) {
+				memcpy(buff + (size_t)i * sector_size, cache_block(idx), sector_size);
+			}
+		}
+		stats.misses += count;
+		return RES_OK;
+	}
+
+	for (i = 0; i < count; i += run) {
+		uint32_t idx = cache_lookup(sector + i);
+		BYTE *dst = buff + (size_t)i * sector_size;
+
+		if (idx != CACHE_NONE) {
+			memcpy(dst, cache_block(idx), sector_size);
+			lru_touch(idx);
+			stats.hits++;
+			run = 1;
+			continue;
+		}
+
+		// read the whole run of missing sectors in one backend call
+		for (run = 1; i + run < count && cache_lookup(sector + i + run) == CACHE_NONE; run++) ;
+		res = RAM_disk_read(dst, sector + i, run);
+		if (res != RES_OK) {
+			return res;
+		}
+		stats.misses += run;
+
+		for (UINT j = 0; j < run; j++) {
+			res = cache_insert(sector + i + j, &idx);
+			if (res != RES_OK) {
+				return res;
+			}
+			memcpy(cache_block(idx), dst + (size_t)j * sector_size, sector_size);
+		}
+	}
+	return RES_OK;
+}
+
+DRESULT
+cache_write(const BYTE *buff, LBA_t sector, UINT count) {
+	DRESULT res;
+	UINT i;
+
+	if (!cache_enabled()) {
+		return RAM_disk_write(buff, sector, count);
+	}
+
+	if (cache_bypass(count)) {
+		res = RAM_disk_write(buff, sector, count);
+		if (res != RES_OK) {
+			return res;
+		}
+		for (i = 0; i < count; i++) {
+			uint32_t idx = cache_lookup(sector + i);
+			if (idx != CACHE_NONE) {
+				memcpy(cache_block(idx), buff + (size_t)i * sector_size, sector_size);
+				entries[idx].dirty = 0;
+			}
+		}
+		return RES_OK;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint32_t idx = cache_lookup(sector + i);
+
+		if (idx == CACHE_NONE) {
+			res = cache_insert(sector + i, &idx);
+			if (res != RES_OK) {
+				return res;
+			}
+		} else {
+			lru_touch(idx);
+		}
+		memcpy(cache_block(idx), buff + (size_t)i * sector_size, sector_size);
+		entries[idx].dirty = 1;
+	}
+	return RES_OK;
+}
+
+static void
+cache_drop(uint32_t idx) {
+	struct cache_entry *e = &entries[idx];
+
+	hash_remove(idx);
+	e->valid = 0;
+	e->dirty = 0;
+	// reuse before anything that still holds data
+	lru_unlink(idx);
+	lru_push_tail(idx);
+}
+
+/* Forget cached copies of sectors whose contents no longer matter, dirty or not */
+void
+cache_discard(LBA_t sector, LBA_t count) {
+	if (!cache_enabled()) {
+		return;
+	}
+
+	if (count < n_entries) {
+		for (LBA_t i = 0; i < count; i++) {
+			uint32_t idx = cache_lookup(sector + i);
+			if (idx != CACHE_NONE) {
+				cache_drop(idx);
+			}
+		}
+		return;
+	}
+	for (uint32_t idx = 0; idx < n_entries; idx++) {
+		if (entries[idx].valid && entries[idx].sector >= sector && entries[idx].sector - sector < count) {
+			cache_drop(idx);
+		}
+	}
+}
+
+static int
+cache_cmp_sector(const void *a, const void *b) {
+	LBA_t sa = entries[*(const uint32_t *)a].sector;
+	LBA_t sb = entries[*(const uint32_t *)b].sector;
+
+	return (sa > sb) - (sa < sb);
+}
+
+DRESULT
+cache_sync(void) {
+	static BYTE run_buf[CACHE_FLUSH_RUN * _MAX_SS];
+	uint32_t *dirty;
+	uint32_t n_dirty = 0;
+	DRESULT res = RES_OK;
+
+	if (!cache_enabled()) {
+		return RES_OK;
+	}
+
+	for (uint32_t i = 0; i < n_entries; i++) {
+		n_dirty += entries[i].valid && entries[i].dirty;
+	}
+	if (n_dirty == 0) {
+		return RES_OK;
+	}
+
+	dirty = malloc(n_dirty * sizeof(*dirty));
+	if (!dirty) {
+		// write them back one by one rather than fail the sync
+		for (uint32_t i = 0; i < n_entries && res == RES_OK; i++) {
+			if (entries[i].valid && entries[i].dirty) {
+				res = cache_writeback(i);
+			}
+		}
+		return res;
+	}
+
+	n_dirty = 0;
+	for (uint32_t i = 0; i < n_entries; i++) {
+		if (entries[i].valid && entries[i].dirty) {
+			dirty[n_dirty++] = i;
+		}
+	}
+	qsort(dirty, n_dirty, sizeof(*dirty), cache_cmp_sector);
+
+	// write back runs of adjacent sectors with a single backend call each
+	for (uint32_t i = 0; i < n_dirty && res == RES_OK; ) {
+		LBA_t start = entries[dirty[i]].sector;
+		UINT run = 0;
+
+		while (i + run < n_dirty && run < CACHE_FLUSH_RUN && entries[dirty[i + run]].sector == start + run) {
+			memcpy(run_buf + (size_t)run * sector_size, cache_block(dirty[i + run]), sector_size);
+			run++;
+		}
+		res = RAM_disk_write(run_buf, start, run);
+		if (res == RES_OK) {
+			for (UINT j = 0; j < run; j++) {
+				entries[dirty[i + j]].dirty = 0;
+			}
+			stats.writebacks += run;
+		}
+		i += run;
+	}
+
+	free(dirty);
+	return res;
+}
+
+void
+cache_get_stats(struct cache_stats *out) {
+	*out = stats;
+}
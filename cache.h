@@ -0,0 +1,46 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "elmchan/src/diskio.h"
+
+struct cache_stats {
+	uint64_t hits;		// sectors served from the cache
+	uint64_t misses;	// sectors that had to be read from the backend
+	uint64_t writebacks;	// dirty sectors written to the backend
+	uint64_t evictions;	// sectors dropped to make room
+};
+
+int cache_init(size_t bytes, UINT sector_size);
+DRESULT cache_shutdown(void);	// writes back dirty sectors first
+int cache_enabled(void);
+DRESULT cache_read(BYTE *buff, LBA_t sector, UINT count);
+DRESULT cache_write(const BYTE *buff, LBA_t sector, UINT count);
+DRESULT cache_sync(void);
+void cache_discard(LBA_t sector, LBA_t count);
+void cache_get_stats(struct cache_stats *stats);
@@ -8,6 +8,9 @@
 /*-----------------------------------------------------------------------*/
 
 #include "diskio.h"		/* FatFs lower layer API */
+#include "../../cache.h"	/* Sector cache in front of the RAM drive */
+#include "../../stats.h"	/* I/O counters for --stats */
+#include "../../trace.h"	/* I/O trace for --trace-io */
 
 /* Definitions of physical drive number for each drive */
 #define DEV_RAM		0	/* Example: Map Ramdisk to physical drive 0 */
@@ -103,18 +106,27 @@ DSTATUS disk_initialize (
 DRESULT disk_read (
 	BYTE pdrv,		/* Physical drive nmuber to identify the drive */
 	BYTE *buff,		/* Data buffer to store read data */
-	DWORD sector,	/* Start sector in LBA */
+	LBA_t sector,	/* Start sector in LBA */
 	UINT count		/* Number of sectors to read */
 )
 {
 	DRESULT res;
 	int result;
+	uint64_t start;
+	enum io_class class;
 
 	switch (pdrv) {
 	case DEV_RAM :
 		// translate the arguments here
 
-		res = RAM_disk_read(buff, sector, count);
+		start = stats_now_ns();
+		res = cache_read(buff, sector, count);
+		io_stats.io_ns += stats_now_ns() - start;
+		class = stats_class(buff, sector);
+		io_stats.reads++;
+		io_stats.read_sectors += count;
+		io_stats.class_sectors[class] += count;
+		trace_rw('R', sector, count, class, start);
 
 		// translate the reslut code here
 
@@ -151,18 +163,27 @@ DRESULT disk_read (
 DRESULT disk_write (
 	BYTE pdrv,			/* Physical drive nmuber to identify the drive */
 	const BYTE *buff,	/* Data to be written */
-	DWORD sector,		/* Start sector in LBA */
+	LBA_t sector,		/* Start sector in LBA */
 	UINT count			/* Number of sectors to write */
 )
 {
 	DRESULT res;
 	int result;
+	uint64_t start;
+	enum io_class class;
 
 	switch (pdrv) {
 	case DEV_RAM :
 		// translate the arguments here
 
-		res = RAM_disk_write(buff, sector, count);
+		start = stats_now_ns();
+		res = cache_write(buff, sector, count);
+		io_stats.io_ns += stats_now_ns() - start;
+		class = stats_class(buff, sector);
+		io_stats.writes++;
+		io_stats.write_sectors += count;
+		io_stats.class_sectors[class] += count;
+		trace_rw('W', sector, count, class, start);
 
 		// translate the reslut code here
 
@@ -204,12 +225,27 @@ DRESULT disk_ioctl (
 {
 	DRESULT res;
 	int result;
+	uint64_t start;
 
 	switch (pdrv) {
 	case DEV_RAM :
 
 		// Process of the command for the RAM drive
+		start = stats_now_ns();
+		trace_ioctl(cmd, buff, start);
+		if (cmd == CTRL_SYNC) {
+			io_stats.syncs++;
+			res = cache_sync();		// write back dirty sectors before the backend syncs
+			if (res != RES_OK) {
+				io_stats.io_ns += stats_now_ns() - start;
+				return res;
+			}
+		} else if (cmd == CTRL_TRIM) {
+			LBA_t *range = buff;	// first and last sector, inclusive
+			cache_discard(range[0], range[1] - range[0] + 1);
+		}
 		res = RAM_disk_ioctl(cmd, buff);
+		io_stats.io_ns += stats_now_ns() - start;
 		return res;
 
 	case DEV_MMC :
@@ -884,7 +884,7 @@ FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
 	FATFS* fs			/* File system object */
 )
 {
-	DWORD wsect;
+	LBA_t wsect;
 	UINT nf;
 	FRESULT res = FR_OK;
 
@@ -911,7 +911,7 @@ FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
 static
 FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
 	FATFS* fs,			/* File system object */
-	DWORD sector		/* Sector number to make appearance in the fs->win[] */
+	LBA_t sector		/* Sector number to make appearance in the fs->win[] */
 )
 {
 	FRESULT res = FR_OK;
@@ -923,7 +923,7 @@ FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
 #endif
 		if (res == FR_OK) {			/* Fill sector window with new data */
 			if (disk_read(fs->drv, fs->win, sector, 1) != RES_OK) {
-				sector = 0xFFFFFFFF;	/* Invalidate window if data is not reliable */
+				sector = (LBA_t)0 - 1;	/* Invalidate window if data is not reliable */
 				res = FR_DISK_ERR;
 			}
 			fs->winsect = sector;
@@ -980,14 +980,14 @@ FRESULT sync_fs (	/* FR_OK:succeeded, !=0:error */
 /*-----------------------------------------------------------------------*/
 
 static
-DWORD clust2sect (	/* !=0:Sector number, 0:Failed (invalid cluster#) */
+LBA_t clust2sect (	/* !=0:Sector number, 0:Failed (invalid cluster#) */
 	FATFS* fs,		/* File system object */
 	DWORD clst		/* Cluster# to be converted */
 )
 {
 	clst -= 2;
 	if (clst >= fs->n_fatent - 2) return 0;		/* Invalid cluster# */
-	return clst * fs->csize + fs->database;
+	return (LBA_t)clst * fs->csize + fs->database;
 }
 
 
@@ -1193,7 +1193,7 @@ FRESULT change_bitmap (
 {
 	BYTE bm;
 	UINT i;
-	DWORD sect;
+	LBA_t sect;
 
 	clst -= 2;	/* The first bit corresponds to cluster #2 */
 	sect = fs->database + clst / 8 / SS(fs);	/* Sector address (assuming bitmap is located top of the cluster heap) */
@@ -1281,7 +1281,7 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 	DWORD scl = clst, ecl = clst;
 #endif
 #if _USE_TRIM
-	DWORD rt[2];
+	LBA_t rt[2];
 #endif
 
 	if (clst < 2 || clst >= fs->n_fatent) return FR_INT_ERR;	/* Check if in valid range */
@@ -2964,10 +2964,10 @@ int get_ldnumber (		/* Returns logical drive number (-1:invalid drive) */
 static
 BYTE check_fs (	/* 0:FAT, 1:exFAT, 2:Valid BS but not FAT, 3:Not a BS, 4:Disk error */
 	FATFS* fs,	/* File system object */
-	DWORD sect	/* Sector# (lba) to load and check if it is an FAT-VBR or not */
+	LBA_t sect	/* Sector# (lba) to load and check if it is an FAT-VBR or not */
 )
 {
-	fs->wflag = 0; fs->winsect = 0xFFFFFFFF;		/* Invaidate window */
+	fs->wflag = 0; fs->winsect = (LBA_t)0 - 1;		/* Invaidate window */
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load boot record */
 
 	if (ld_word(fs->win + BS_55AA) != 0xAA55) return 3;	/* Check boot record signature (always placed here even if the sector size is >512) */
@@ -2999,7 +2999,8 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	BYTE fmt, *pt;
 	int vol;
 	DSTATUS stat;
-	DWORD bsect, fasize, tsect, sysect, nclst, szbfat, br[4];
+	DWORD fasize, tsect, sysect, nclst, szbfat, br[4];
+	LBA_t bsect;
 	WORD nrsv;
 	FATFS *fs;
 	UINT i;
@@ -3079,7 +3080,7 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 		}
 
 		maxlba = ld_qword(fs->win + BPB_TotSecEx) + bsect;	/* Last LBA + 1 of the volume */
-		if (maxlba >= 0x100000000) return FR_NO_FILESYSTEM;	/* (It cannot be handled in 32-bit LBA) */
+		if (!_LBA64 && maxlba >= 0x100000000) return FR_NO_FILESYSTEM;	/* (It cannot be handled in 32-bit LBA) */
 
 		fs->fsize = ld_dword(fs->win + BPB_FatSzEx);	/* Number of sectors per FAT */
 
@@ -3097,7 +3098,7 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 		fs->volbase = bsect;
 		fs->database = bsect + ld_dword(fs->win + BPB_DataOfsEx);
 		fs->fatbase = bsect + ld_dword(fs->win + BPB_FatOfsEx);
-		if (maxlba < (QWORD)fs->database + nclst * fs->csize) return FR_NO_FILESYSTEM;	/* (Volume size must not be smaller than the size requiered) */
+		if (maxlba < (QWORD)fs->database + (QWORD)nclst * fs->csize) return FR_NO_FILESYSTEM;	/* (Volume size must not be smaller than the size requiered) */
 		fs->dirbase = ld_dword(fs->win + BPB_RootClusEx);
 
 		/* Check if bitmap location is in assumption (at the first cluster) */
@@ -3304,7 +3305,8 @@ FRESULT f_open (
 	DIR dj;
 	FATFS *fs;
 #if !_FS_READONLY
-	DWORD dw, cl, bcs, clst, sc;
+	DWORD dw, cl, bcs, clst;
+	LBA_t sc;
 	FSIZE_t ofs;
 #endif
 	DEF_NAMBUF
@@ -3387,10 +3389,10 @@ FRESULT f_open (
 					fs->wflag = 1;
 
 					if (cl) {							/* Remove the cluster chain if exist */
-						dw = fs->winsect;
+						sc = fs->winsect;
 						res = remove_chain(&dj.obj, cl, 0);
 						if (res == FR_OK) {
-							res = move_window(fs, dw);
+							res = move_window(fs, sc);
 							fs->last_clst = cl - 1;		/* Reuse the cluster hole */
 						}
 					}
@@ -3506,7 +3508,8 @@ FRESULT f_read (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD clst, sect;
+	DWORD clst;
+	LBA_t sect;
 	FSIZE_t remain;
 	UINT rcnt, cc, csect;
 	BYTE *rbuff = (BYTE*)buff;
@@ -3606,7 +3609,8 @@ FRESULT f_write (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD clst, sect;
+	DWORD clst;
+	LBA_t sect;
 	UINT wcnt, cc, csect;
 	const BYTE *wbuff = (const BYTE*)buff;
 
@@ -3994,10 +3998,12 @@ FRESULT f_lseek (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD clst, bcs, nsect;
+	DWORD clst, bcs;
+	LBA_t nsect;
 	FSIZE_t ifptr;
 #if _USE_FASTSEEK
-	DWORD cl, pcl, ncl, tcl, dsc, tlen, ulen, *tbl;
+	DWORD cl, pcl, ncl, tcl, tlen, ulen, *tbl;
+	LBA_t dsc;
 #endif
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
@@ -4382,7 +4388,8 @@ FRESULT f_getfree (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD nfree, clst, sect, stat;
+	DWORD nfree, clst, stat;
+	LBA_t sect;
 	UINT i;
 	BYTE *p;
 	_FDID obj;
@@ -4615,7 +4622,8 @@ FRESULT f_mkdir (
 	FATFS *fs;
 	BYTE *dir;
 	UINT n;
-	DWORD dsc, dcl, pcl, tm;
+	DWORD dcl, pcl, tm;
+	LBA_t dsc;
 	DEF_NAMBUF
 
 
@@ -5225,7 +5233,8 @@ FRESULT f_forward (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD clst, sect;
+	DWORD clst;
+	LBA_t sect;
 	FSIZE_t remain;
 	UINT rcnt, csect;
 	BYTE *dbuf;
@@ -5301,14 +5310,15 @@ FRESULT f_mkfs (
 	static const WORD cst32[] = {1, 2, 4, 8, 16, 32, 0};	/* Cluster size boundary for FAT32 volume (128Ks unit) */
 	BYTE fmt, sys, *buf, *pte, pdrv, part;
 	WORD ss;
-	DWORD szb_buf, sz_buf, sz_blk, n_clst, pau, sect, nsect, n;
-	DWORD b_vol, b_fat, b_data;				/* Base LBA for volume, fat, data */
-	DWORD sz_vol, sz_rsv, sz_fat, sz_dir;	/* Size for volume, fat, dir, data */
+	DWORD szb_buf, sz_buf, sz_blk, n_clst, pau, nsect, n;
+	LBA_t sect, b_vol, b_fat, b_data;		/* Base LBA for volume, fat, data */
+	LBA_t sz_vol;							/* Size for volume */
+	DWORD sz_rsv, sz_fat, sz_dir;			/* Size for fat, dir, data */
 	UINT i;
 	int vol;
 	DSTATUS stat;
 #if _USE_TRIM || _FS_EXFAT
-	DWORD tbl[3];
+	LBA_t tbl[3];
 #endif
 
 
@@ -5351,6 +5361,7 @@ FRESULT f_mkfs (
 	} else {
 		/* Create a single-partition in this function */
 		if (disk_ioctl(pdrv, GET_SECTOR_COUNT, &sz_vol) != RES_OK) return FR_DISK_ERR;
+		if (_LBA64 && sz_vol >= 0x100000000) opt |= FM_SFD;	/* MBR cannot describe the volume, create it as SFD */
 		b_vol = (opt & FM_SFD) ? 0 : 63;		/* Volume start sector */
 		if (sz_vol < b_vol) return FR_MKFS_ABORTED;
 		sz_vol -= b_vol;						/* Volume size */
@@ -5365,6 +5376,7 @@ FRESULT f_mkfs (
 			}
 		}
 		if (au > 128) return FR_INVALID_PARAMETER;	/* Too large au for FAT/FAT32 */
+		if (_LBA64 && sz_vol >= 0x100000000) return FR_MKFS_ABORTED;	/* Too large volume for FAT/FAT32 */
 		if (opt & FM_FAT32) {	/* FAT32 possible? */
 			if ((opt & FM_ANY) == FM_FAT32 || !(opt & FM_FAT)) {	/* FAT32 only or no-FAT? */
 				fmt = FS_FAT32; break;
@@ -5396,9 +5408,9 @@ FRESULT f_mkfs (
 		sz_fat = ((sz_vol / au + 2) * 4 + ss - 1) / ss;			/* Number of FAT sectors */
 		b_data = (b_fat + sz_fat + sz_blk - 1) & ~(sz_blk - 1);	/* Align data area to the erase block boundary */
 		if (b_data >= sz_vol / 2) return FR_MKFS_ABORTED;		/* Too small volume? */
-		n_clst = (sz_vol - (b_data - b_vol)) / au;				/* Number of clusters */
+		if ((sz_vol - (b_data - b_vol)) / au > MAX_EXFAT) return FR_MKFS_ABORTED;	/* Too many clusters? */
+		n_clst = (DWORD)((sz_vol - (b_data - b_vol)) / au);		/* Number of clusters */
 		if (n_clst <16) return FR_MKFS_ABORTED;					/* Too few clusters? */
-		if (n_clst > MAX_EXFAT) return FR_MKFS_ABORTED;			/* Too many clusters? */
 
 		szb_bit = (n_clst + 7) / 8;						/* Size of allocation bitmap */
 		tbl[0] = (szb_bit + au * ss - 1) / (au * ss);	/* Number of allocation bitmap clusters */
@@ -5498,11 +5510,11 @@ FRESULT f_mkfs (
 			/* Main record (+0) */
 			mem_set(buf, 0, ss);
 			mem_cpy(buf + BS_JmpBoot, "\xEB\x76\x90" "EXFAT   ", 11);	/* Boot jump code (x86), OEM name */
-			st_dword(buf + BPB_VolOfsEx, b_vol);					/* Volume offset in the physical drive [sector] */
-			st_dword(buf + BPB_TotSecEx, sz_vol);					/* Volume size [sector] */
-			st_dword(buf + BPB_FatOfsEx, b_fat - b_vol);			/* FAT offset [sector] */
+			st_qword(buf + BPB_VolOfsEx, b_vol);					/* Volume offset in the physical drive [sector] */
+			st_qword(buf + BPB_TotSecEx, sz_vol);					/* Volume size [sector] */
+			st_dword(buf + BPB_FatOfsEx, (DWORD)(b_fat - b_vol));	/* FAT offset [sector] */
 			st_dword(buf + BPB_FatSzEx, sz_fat);					/* FAT size [sector] */
-			st_dword(buf + BPB_DataOfsEx, b_data - b_vol);			/* Data offset [sector] */
+			st_dword(buf + BPB_DataOfsEx, (DWORD)(b_data - b_vol));	/* Data offset [sector] */
 			st_dword(buf + BPB_NumClusEx, n_clst);					/* Number of clusters */
 			st_dword(buf + BPB_RootClusEx, 2 + tbl[0] + tbl[1]);	/* Root dir cluster # */
 			st_dword(buf + BPB_VolIDEx, GET_FATTIME());				/* VSN */
@@ -5624,12 +5636,12 @@ FRESULT f_mkfs (
 		if (sz_vol < 0x10000) {
 			st_word(buf + BPB_TotSec16, (WORD)sz_vol);	/* Volume size in 16-bit LBA */
 		} else {
-			st_dword(buf + BPB_TotSec32, sz_vol);		/* Volume size in 32-bit LBA */
+			st_dword(buf + BPB_TotSec32, (DWORD)sz_vol);	/* Volume size in 32-bit LBA */
 		}
 		buf[BPB_Media] = 0xF8;							/* Media descriptor byte */
 		st_word(buf + BPB_SecPerTrk, 63);				/* Number of sectors per track (for int13) */
 		st_word(buf + BPB_NumHeads, 255);				/* Number of heads (for int13) */
-		st_dword(buf + BPB_HiddSec, b_vol);				/* Volume offset in the physical drive [sector] */
+		st_dword(buf + BPB_HiddSec, (DWORD)b_vol);		/* Volume offset in the physical drive [sector] */
 		if (fmt == FS_FAT32) {
 			st_dword(buf + BS_VolID32, GET_FATTIME());	/* VSN */
 			st_dword(buf + BPB_FATSz32, sz_fat);		/* FAT size [sector] */
@@ -5722,12 +5734,12 @@ FRESULT f_mkfs (
 			pte[PTE_StSec] = 1;					/* Start sector */
 			pte[PTE_StCyl] = 0;					/* Start cylinder */
 			pte[PTE_System] = sys;				/* System type */
-			n = (b_vol + sz_vol) / (63 * 255);	/* (End CHS may be invalid) */
+			n = (DWORD)((b_vol + sz_vol) / (63 * 255));	/* (End CHS may be invalid) */
 			pte[PTE_EdHead] = 254;				/* End head */
 			pte[PTE_EdSec] = (BYTE)(n >> 2 | 63);	/* End sector */
 			pte[PTE_EdCyl] = (BYTE)n;			/* End cylinder */
-			st_dword(pte + PTE_StLba, b_vol);	/* Start offset in LBA */
-			st_dword(pte + PTE_SizLba, sz_vol);	/* Size in sectors */
+			st_dword(pte + PTE_StLba, (DWORD)b_vol);	/* Start offset in LBA */
+			st_dword(pte + PTE_SizLba, (DWORD)sz_vol);	/* Size in sectors */
 			if (disk_write(pdrv, buf, 0, 1) != RES_OK) return FR_DISK_ERR;	/* Write it to the MBR */
 		}
 	}
@@ -171,7 +171,7 @@
 
 
 #define	_MIN_SS		512
-#define	_MAX_SS		512
+#define	_MAX_SS		4096
 /* These options configure the range of sector size to be supported. (512, 1024,
 /  2048 or 4096) Always set both 512 for most systems, generic memory card and
 /  harddisk. But a larger value may be required for on-board flash memory and some
@@ -180,7 +180,7 @@
 /  the disk_ioctl() function. */
 
 
-#define	_USE_TRIM	0
+#define	_USE_TRIM	1
 /* This option switches support of ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -216,6 +216,12 @@
 /  Note that enabling exFAT discards ANSI C (C89) compatibility. */
 
 
+#define _LBA64		1
+/* This option switches support for 64-bit LBA. (0:Disable or 1:Enable)
+/  To enable 64-bit LBA, also exFAT needs to be enabled. (_FS_EXFAT == 1)
+/  Volumes of 2^32 sectors or more can only be created and mounted as exFAT. */
+
+
 #define _FS_NORTC	0
 #define _NORTC_MON	1
 #define _NORTC_MDAY	1
@@ -23,15 +23,41 @@
 / (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 / SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /----------------------------------------------------------------------------*/
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "backend.h"
+#include "cache.h"
 #include "elmchan_impl.h"
+#include "stats.h"
 #include "elmchan/src/diskio.h"
 
 static char image_path[4096];
-static FILE *image = NULL;
-static uint32_t image_size = 0;
+static char journal_path[sizeof(image_path) + 8];
+static char overlay_path[sizeof(image_path)];
+static struct disk_backend *disk = NULL;
+static UINT sector_size = FATBOY_SECTOR_SIZE;	// file system sector size
+static UINT sector_shift = 0;			// log2 of backend units per sector
+static unsigned partition = 0;
+
+// durability policy and what has happened since the last flush
+static enum fatboy_sync_policy sync_policy = FATBOY_SYNC_NONE;
+static unsigned sync_ops;
+static uint64_t sync_bytes;
+static unsigned syncs_pending;
+static uint64_t bytes_pending;
+static int unflushed;
+static LBA_t next_sector;	// where the last image access ended, for counting seeks
+
+// ranges of backend units known to read as zeros, split up as they are written
+#define ZERO_EXTENTS	16
+static struct {
+	LBA_t lo, hi;
+} zero[ZERO_EXTENTS];
 
 static const char *FR_RESULT_Strings[] = {
 	"FR_OK",                  /* (0) Succeeded */
@@ -61,30 +87,315 @@ fr_res_to_str(uint32_t fr_res) {
 	return FR_RESULT_Strings[fr_res];
 }
 
-int32_t
-fatboy_set_image(const char *path) {
-	image = fopen(path, "r+b");
-	if (!image) {
-		printf("ERROR: could not open image '%s'\n", path);
-		return -1;
+/* Sector size a volume boot record was formatted with, 0 if it is not one */
+static UINT
+vbr_sector_size(const BYTE *vbr) {
+	UINT ss;
+
+	if (vbr[510] != 0x55 || vbr[511] != 0xAA) {
+		return 0;
+	}
+	if (memcmp(vbr + 3, "EXFAT   ", 8) == 0) {
+		ss = vbr[108] >= 9 && vbr[108] <= 12 ? 1u << vbr[108] : 0;
+	} else if (vbr[0] == 0xEB || vbr[0] == 0xE9 || vbr[0] == 0xE8) {
+		ss = vbr[11] | vbr[12] << 8;
+	} else {
+		return 0;
+	}
+	return ss >= _MIN_SS && ss <= _MAX_SS && !(ss & (ss - 1)) ? ss : 0;
+}
+
+/*
+ * Image files do not know their sector size, so look at what they were
+ * formatted with: a volume boot record at the start, a GPT header in the
+ * second sector, or the boot record of the first MBR partition. Blank and
+ * unrecognised images get the 512 byte default.
+ */
+static UINT
+detect_sector_size(void) {
+	BYTE buf[_MAX_SS * 2];
+	UINT units = sizeof(buf) / FATBOY_SECTOR_SIZE;
+	UINT ss;
+
+	if (disk->size < sizeof(buf)) {
+		return FATBOY_SECTOR_SIZE;
+	}
+	if (disk->read(disk, buf, 0, units) != RES_OK) {
+		return FATBOY_SECTOR_SIZE;
 	}
 
+	ss = vbr_sector_size(buf);
+	if (ss) {
+		return ss;
+	}
+	if (buf[510] != 0x55 || buf[511] != 0xAA) {
+		return FATBOY_SECTOR_SIZE;
+	}
+	for (ss = _MIN_SS; ss <= _MAX_SS; ss <<= 1) {
+		if (memcmp(buf + ss, "EFI PART", 8) == 0) {
+			return ss;
+		}
+	}
+	for (int i = 0; i < 4; i++) {
+		const BYTE *pte = buf + 446 + i * 16;
+		uint64_t start = pte[8] | pte[9] << 8 | pte[10] << 16 | (uint64_t)pte[11] << 24;
+
+		if (pte[4] == 0 || start == 0) {
+			continue;
+		}
+		for (ss = _MIN_SS; ss <= _MAX_SS; ss <<= 1) {
+			BYTE vbr[FATBOY_SECTOR_SIZE];
+			uint64_t unit = start * (ss / FATBOY_SECTOR_SIZE);
+
+			if ((unit + 1) * FATBOY_SECTOR_SIZE <= disk->size
+					&& disk->read(disk, vbr, unit, 1) == RES_OK && vbr_sector_size(vbr) == ss) {
+				return ss;
+			}
+		}
+		break;
+	}
+	return FATBOY_SECTOR_SIZE;
+}
+
+int32_t
+fatboy_set_image(const char *path, const struct fatboy_image_opts *opts) {
+	enum fatboy_backend_type type = opts->backend;
+	int flags;
+	char *at;
+
+	// "disk.img@p2" is partition 2 of disk.img, unless a file has that name
 	strncpy(image_path, path, sizeof(image_path));
 	image_path[sizeof(image_path)-1] = '\0';
+	partition = opts->partition;
+	at = strrchr(image_path, '@');
+	if (at && at[1] == 'p' && isdigit((unsigned char)at[2]) && at[2 + strspn(at + 2, "0123456789")] == '\0'
+			&& access(path, F_OK) != 0) {
+		partition = (unsigned)strtoul(at + 2, NULL, 10);
+		*at = '\0';
+	}
+	path = image_path;
+	if (opts->overlay && opts->transaction) {
+		printf("ERROR: an overlay can not be used in a transaction\n");
+		return -1;
+	}
+
+	// the base of an overlay is only read, so it can be shared
+	if (opts->overlay && (type == FATBOY_BACKEND_MMAP || type == FATBOY_BACKEND_URING || type == FATBOY_BACKEND_MEMORY)) {
+		type = FATBOY_BACKEND_FILE;
+	}
+	flags = (opts->direct ? FILE_BACKEND_DIRECT : 0) | (opts->overlay ? FILE_BACKEND_RDONLY : 0);
+
+	if (split_backend_probe(path)) {
+		type = FATBOY_BACKEND_SPLIT;
+	} else if (simg_backend_probe(path)) {
+		type = FATBOY_BACKEND_SIMG;
+	} else if (qcow2_backend_probe(path)) {
+		type = FATBOY_BACKEND_QCOW2;
+	} else if (zstd_backend_probe(path)) {
+		type = FATBOY_BACKEND_ZSTD;
+	}
+
+	// an image too big for memory is used in place instead
+	if (type == FATBOY_BACKEND_MEMORY) {
+		disk = memory_backend_open(path, opts->memory_bytes);
+		if (!disk) {
+			type = FATBOY_BACKEND_FILE;
+		}
+	}
 
-	fseek(image, 0, SEEK_END);
-	image_size = ftell(image);
+	switch (type) {
+		case FATBOY_BACKEND_MEMORY:
+			break;
+		case FATBOY_BACKEND_SIMG:
+			disk = simg_backend_open(path);
+			break;
+		case FATBOY_BACKEND_QCOW2:
+			// batching small writes saves copying a cluster for each of them
+			disk = qcow2_backend_open(path, opts->overlay != NULL);
+			if (disk) {
+				disk = coalesce_backend_open(disk, opts->coalesce_bytes);
+				disk = readahead_backend_open(disk, opts->readahead_bytes);
+			}
+			break;
+		case FATBOY_BACKEND_SPLIT:
+			disk = split_backend_open(path, flags);
+			if (disk) {
+				disk = coalesce_backend_open(disk, opts->coalesce_bytes);
+				disk = readahead_backend_open(disk, opts->readahead_bytes);
+			}
+			break;
+		case FATBOY_BACKEND_ZSTD:
+			disk = zstd_backend_open(path);
+			break;
+		case FATBOY_BACKEND_MMAP:
+			disk = mmap_backend_open(path);
+			break;
+		case FATBOY_BACKEND_URING:
+			disk = uring_backend_open(path, opts->uring_depth, opts->readahead_bytes);
+			if (disk) {
+				disk = coalesce_backend_open(disk, opts->coalesce_bytes);
+				break;
+			}
+			// fall back to synchronous I/O
+		case FATBOY_BACKEND_FILE:
+		default:
+			disk = file_backend_open(path, flags);
+			if (disk) {
+				disk = coalesce_backend_open(disk, opts->coalesce_bytes);
+				disk = readahead_backend_open(disk, opts->readahead_bytes);
+			}
+			break;
+	}
+	// a journal left next to the image by an interrupted transaction is
+	// finished or rolled back before anything else reads the image
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", path);
+	if (disk && !opts->overlay && disk->write && journal_recover(disk, journal_path) != 0) {
+		disk->close(disk);
+		disk = NULL;
+	}
+	if (disk && opts->transaction) {
+		struct disk_backend *jb = journal_backend_open(disk, journal_path);
 
-	if (image_size % FATBOY_SECTOR_SIZE != 0) {
-		printf("ERROR: %d is not a multiple of 512 bytes\n", image_size);
-		fclose(image);
+		if (!jb) {
+			disk->close(disk);
+		}
+		disk = jb ? coalesce_backend_open(jb, opts->coalesce_bytes) : NULL;
+	}
+	if (disk && opts->overlay) {
+		struct disk_backend *ov = overlay_backend_open(disk, opts->overlay);
+
+		strncpy(overlay_path, opts->overlay, sizeof(overlay_path) - 1);
+
+		if (!ov) {
+			disk->close(disk);
+		}
+		disk = ov ? coalesce_backend_open(ov, opts->coalesce_bytes) : NULL;
+	}
+	if (!disk) {
 		memset(image_path, '\0', sizeof(image_path));
-		image_size = 0;
+		return -1;
+	}
+
+	if (disk->size % FATBOY_SECTOR_SIZE != 0) {
+		printf("ERROR: %llu is not a multiple of 512 bytes\n", (unsigned long long)disk->size);
+		fatboy_close_image();
 		return -2;
 	}
+
+	// block devices dictate the sector size, images are asked or probed
+	sector_size = opts->sector_size;
+	if (disk->sector_size) {
+		if (sector_size && sector_size != disk->sector_size) {
+			printf("ERROR: '%s' has %u byte sectors\n", path, (unsigned)disk->sector_size);
+			fatboy_close_image();
+			return -2;
+		}
+		sector_size = disk->sector_size;
+	} else if (!sector_size) {
+		sector_size = detect_sector_size();
+	}
+	if (sector_size < _MIN_SS || sector_size > _MAX_SS || (sector_size & (sector_size - 1))) {
+		printf("ERROR: %u byte sectors are not supported\n", sector_size);
+		fatboy_close_image();
+		return -2;
+	}
+
+	// the partition table is in the same sector size as the file system
+	if (partition) {
+		struct disk_backend *part = partition_backend_open(disk, partition, sector_size);
+
+		if (!part) {
+			fatboy_close_image();
+			return -2;
+		}
+		disk = part;
+	}
+	for (sector_shift = 0; (FATBOY_SECTOR_SIZE << sector_shift) < sector_size; sector_shift++);
+
+	sync_policy = opts->sync_policy;
+	sync_ops = opts->sync_ops;
+	sync_bytes = opts->sync_bytes;
+	syncs_pending = 0;
+	bytes_pending = 0;
+	unflushed = 0;
+	io_stats.sector_size = sector_size;
+
+	if (cache_init(opts->cache_bytes, sector_size) != 0) {
+		fatboy_close_image();
+		return -3;
+	}
 	return 0;
 }
 
+/* Make everything written so far durable */
+static DRESULT
+image_flush(void) {
+	DRESULT res = disk->flush ? disk->flush(disk) : disk->sync(disk);
+
+	syncs_pending = 0;
+	bytes_pending = 0;
+	unflushed = 0;
+	io_stats.flushes++;
+	return res;
+}
+
+int
+fatboy_close_image(void) {
+	uint64_t start;
+	int ret = 0;
+
+	if (!disk) {
+		return 0;
+	}
+
+	// backends that hold writes back do most of their I/O here, and
+	// the errors of everything written since the last sync show up now
+	start = stats_now_ns();
+	if (cache_shutdown() != RES_OK) {
+		ret = -1;
+	}
+	if (unflushed && image_flush() != RES_OK) {
+		ret = -1;
+	}
+	if (disk->close(disk) != RES_OK) {
+		ret = -1;
+	}
+	io_stats.io_ns += stats_now_ns() - start;
+	disk = NULL;
+	memset(image_path, '\0', sizeof(image_path));
+	memset(overlay_path, '\0', sizeof(overlay_path));
+	memset(zero, 0, sizeof(zero));
+	partition = 0;
+	return ret;
+}
+
+unsigned
+fatboy_partition(void) {
+	return partition;
+}
+
+int
+fatboy_apply_delta(const char *delta_path) {
+	return overlay_apply(disk, delta_path);
+}
+
+static int
+same_file(const char *a, const char *b) {
+	struct stat sa, sb;
+
+	return a[0] && b[0] && stat(a, &sa) == 0 && stat(b, &sb) == 0
+		&& sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+int
+fatboy_export_image(const char *path) {
+	if (same_file(path, image_path) || same_file(path, overlay_path)) {
+		printf("ERROR: can not export onto '%s', it is in use as the image or its delta file\n", path);
+		return -1;
+	}
+	return backend_export(disk, path);
+}
+
 DWORD
 get_fattime(void) {
 	time_t t = time(NULL);
@@ -104,12 +415,12 @@ get_fattime(void) {
 
 DSTATUS
 RAM_disk_initialize() {
-	if (!image) {
+	if (!disk) {
 		printf("ERR\n");
 		return STA_NOINIT;
 	}
 
-	return 0;
+	return disk->write ? 0 : STA_PROTECT;
 }
 
 DSTATUS
@@ -118,34 +429,89 @@ RAM_disk_status() {
 }
 
 DRESULT
-RAM_disk_read(BYTE* buff, DWORD sector, UINT count) {
-	if (!image) {
+RAM_disk_read(BYTE* buff, LBA_t sector, UINT count) {
+	if (!disk) {
 		return RES_NOTRDY;
 	}
 
-	fseek(image, FATBOY_SECTOR_SIZE * sector, SEEK_SET);
-	size_t sectors_read = fread(buff, FATBOY_SECTOR_SIZE, count, image);
-	if (sectors_read != count) {
-		printf("Short read of %d sectors instead of %d\n", sectors_read, count);
-		return RES_ERROR;
+	io_stats.image_reads++;
+	io_stats.image_read_bytes += (uint64_t)count * sector_size;
+	if (sector != next_sector) {
+		io_stats.seeks++;
+	}
+	next_sector = sector + count;
+	return disk->read(disk, buff, sector << sector_shift, count << sector_shift);
+}
+
+static int
+is_zero(const BYTE *buff, size_t len) {
+	return buff[0] == 0 && memcmp(buff, buff + 1, len - 1) == 0;
+}
+
+/* Remember [lo, hi) as zeroed, replacing the smallest extent if all are in use */
+static void
+zero_add(LBA_t lo, LBA_t hi) {
+	int slot = 0;
+
+	for (int i = 1; i < ZERO_EXTENTS; i++) {
+		if (zero[i].hi - zero[i].lo < zero[slot].hi - zero[slot].lo) {
+			slot = i;
+		}
+	}
+	if (hi - lo > zero[slot].hi - zero[slot].lo) {
+		zero[slot].lo = lo;
+		zero[slot].hi = hi;
 	}
-	return RES_OK;
+}
+
+/* 1 if the write can be skipped, otherwise the extents it overlaps are split around it */
+static int
+zero_write(const BYTE *buff, LBA_t lo, LBA_t hi, size_t len) {
+	for (int i = 0; i < ZERO_EXTENTS; i++) {
+		LBA_t z_lo = zero[i].lo, z_hi = zero[i].hi;
+
+		if (lo >= z_hi || z_lo >= hi) {
+			continue;
+		}
+		if (lo >= z_lo && hi <= z_hi && is_zero(buff, len)) {
+			return 1;
+		}
+		zero[i].hi = lo > z_lo ? lo : z_lo;
+		if (z_hi > hi) {
+			zero_add(hi, z_hi);
+		}
+	}
+	return 0;
 }
 
 DRESULT
-RAM_disk_write(const BYTE* buff, DWORD sector, UINT count) {
-	if (!image) {
+RAM_disk_write(const BYTE* buff, LBA_t sector, UINT count) {
+	LBA_t lo = sector << sector_shift;
+	LBA_t hi = lo + ((LBA_t)count << sector_shift);
+
+	if (!disk) {
 		return RES_NOTRDY;
 	}
+	if (!disk->write) {
+		return RES_WRPRT;
+	}
 
-	fseek(image, FATBOY_SECTOR_SIZE * sector, SEEK_SET);
-	size_t sectors_wrote = fwrite(buff, FATBOY_SECTOR_SIZE, count, image);
-	if (sectors_wrote != count) {
-		printf("Short write of %d sectors instead of %d\n", sectors_wrote, count);
-		return RES_ERROR;
+	// trimmed ranges of an image read back as zeros. f_mkfs trims the volume
+	// and then zero fills the FATs, root directory and bitmap; writing
+	// those zeros again would only allocate blocks in a sparse image
+	if (zero_write(buff, lo, hi, (size_t)count * sector_size)) {
+		return RES_OK;
 	}
-	//printf("wrote %d sectors starting at sector %d\n", sectors_wrote, sector);
-	return RES_OK;
+
+	bytes_pending += (uint64_t)count * sector_size;
+	unflushed = 1;
+	io_stats.image_writes++;
+	io_stats.image_write_bytes += (uint64_t)count * sector_size;
+	if (sector != next_sector) {
+		io_stats.seeks++;
+	}
+	next_sector = sector + count;
+	return disk->write(disk, buff, lo, count << sector_shift);
 }
 
 DRESULT
@@ -154,9 +520,10 @@ RAM_disk_ioctl(BYTE cmd, void* buff) {
 		void* ptr_void;
 		WORD* ptr_word;
 		DWORD* ptr_dword;
+		LBA_t* ptr_lba;
 	} ptrs;
 
-	if (!image) {
+	if (!disk) {
 		printf("NO IMAGE!\n");
 		return RES_NOTRDY;
 	}
@@ -165,14 +532,46 @@ RAM_disk_ioctl(BYTE cmd, void* buff) {
 
 	switch (cmd) {
 		case CTRL_SYNC:
-			fflush(image);
-			break;
+			// f_sync and f_close get here for every file
+			switch (sync_policy) {
+				case FATBOY_SYNC_STRICT:
+					return image_flush();
+				case FATBOY_SYNC_BATCH:
+					if (++syncs_pending >= sync_ops || bytes_pending >= sync_bytes) {
+						return image_flush();
+					}
+					return disk->sync(disk);
+				case FATBOY_SYNC_NONE:
+				default:
+					// still hand parked writes to the kernel so their errors are seen now
+					return disk->sync(disk);
+			}
+		case CTRL_TRIM: {
+			// first and last sector of the range, inclusive
+			LBA_t start = ptrs.ptr_lba[0] << sector_shift;
+			LBA_t end = (ptrs.ptr_lba[1] + 1) << sector_shift;
+			DRESULT res;
+
+			if (!disk->trim) {
+				return RES_PARERR;
+			}
+			res = disk->trim(disk, start, end - start);
+			unflushed = 1;
+			io_stats.trims++;
+			if (res == RES_OK && disk->trim_zeroes) {
+				zero_add(start, end);
+			}
+			return res;
+		}
 		case GET_SECTOR_COUNT:
-			*ptrs.ptr_dword = image_size / FATBOY_SECTOR_SIZE;
+			*ptrs.ptr_lba = disk->size / sector_size;
 			break;
 		case GET_SECTOR_SIZE:
+			*ptrs.ptr_word = sector_size;
+			break;
 		case GET_BLOCK_SIZE:
-			*ptrs.ptr_word = FATBOY_SECTOR_SIZE;
+			// in sectors, f_mkfs aligns the data area to it
+			*ptrs.ptr_dword = disk->block_size > sector_size ? disk->block_size / sector_size : 1;
 			break;
 		default:
 			return RES_PARERR;
@@ -194,12 +593,12 @@ MMC_disk_initialize(BYTE pdrv) {
 }
 
 DRESULT
-MMC_disk_read(BYTE* buff, DWORD sector, UINT count) {
+MMC_disk_read(BYTE* buff, LBA_t sector, UINT count) {
 	return RES_NOTRDY;
 }
 
 DRESULT
-MMC_disk_write(const BYTE* buff, DWORD sector, UINT count) {
+MMC_disk_write(const BYTE* buff, LBA_t sector, UINT count) {
 	return RES_NOTRDY;
 }
 
@@ -221,12 +620,12 @@ USB_disk_initialize(BYTE pdrv) {
 }
 
 DRESULT
-USB_disk_read(BYTE* buff, DWORD sector, UINT count) {
+USB_disk_read(BYTE* buff, LBA_t sector, UINT count) {
 	return RES_NOTRDY;
 }
 
 DRESULT
-USB_disk_write(const BYTE* buff, DWORD sector, UINT count) {
+USB_disk_write(const BYTE* buff, LBA_t sector, UINT count) {
 	return RES_NOTRDY;
 }
 
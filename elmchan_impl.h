@@ -23,11 +23,59 @@
 / (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 / SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /----------------------------------------------------------------------------*/
+#pragma once
+
+#include <stddef.h>
 #include <stdint.h>
+#include "elmchan/src/diskio.h"
 
-// support the smallest sector size for maximal compatibility with underlying images
+// backends address images in units of the smallest sector size, file system
+// sectors of 512 to 4096 bytes are mapped onto whole runs of them
 #define FATBOY_SECTOR_SIZE 512
 
+enum fatboy_backend_type {
+	FATBOY_BACKEND_FILE,	// pread/pwrite on a file descriptor
+	FATBOY_BACKEND_MMAP,	// whole image memory mapped
+	FATBOY_BACKEND_URING,	// io_uring with several requests in flight
+	FATBOY_BACKEND_MEMORY,	// whole image held in memory, written back at close
+	FATBOY_BACKEND_SIMG,	// Android sparse image, picked automatically
+	FATBOY_BACKEND_QCOW2,	// QEMU qcow2 image, picked automatically
+	FATBOY_BACKEND_SPLIT,	// image in several chunk files, picked automatically
+	FATBOY_BACKEND_ZSTD,	// zstd seekable compressed image, read only, picked automatically
+};
+
+// when CTRL_SYNC makes the image durable; it always is once it is closed
+enum fatboy_sync_policy {
+	FATBOY_SYNC_NONE,	// never, only when the image is closed; syncs still write back
+	FATBOY_SYNC_BATCH,	// every sync_ops syncs or sync_bytes written, whichever comes first
+	FATBOY_SYNC_STRICT,	// on every sync
+};
+
+struct fatboy_image_opts {
+	enum fatboy_backend_type backend;
+	size_t cache_bytes;	// sector cache size, 0 disables it
+	size_t readahead_bytes;	// largest sequential read-ahead window, 0 disables it
+	size_t coalesce_bytes;	// writes parked for combining before a flush, 0 disables it
+	unsigned uring_depth;	// io_uring queue depth
+	uint64_t memory_bytes;	// largest image held in memory, bigger ones use the file backend
+	int direct;		// file backend: bypass the page cache
+	unsigned sector_size;	// file system sector size for images, 0 detects it
+	unsigned partition;	// MBR or GPT partition to use, 0 for the whole image
+	const char *overlay;	// delta file taking all writes, the image is only read; NULL for none
+	int transaction;	// journal all writes and commit them to the image at close
+	enum fatboy_sync_policy sync_policy;
+	unsigned sync_ops;	// batch policy: syncs between flushes
+	uint64_t sync_bytes;	// batch policy: bytes written between flushes
+};
+
 const char* fr_res_to_str(uint32_t fr_res);
-int32_t fatboy_set_image(const char *path);
+int32_t fatboy_set_image(const char *path, const struct fatboy_image_opts *opts);
+int fatboy_close_image(void);	// 0, or -1 if writing back what was held failed
+unsigned fatboy_partition(void);	// partition in use, 0 for the whole image
+int fatboy_apply_delta(const char *delta_path);
+int fatboy_export_image(const char *path);
+
+DRESULT RAM_disk_read(BYTE* buff, LBA_t sector, UINT count);
+DRESULT RAM_disk_write(const BYTE* buff, LBA_t sector, UINT count);
+DRESULT RAM_disk_ioctl(BYTE cmd, void* buff);
 
@@ -24,13 +24,19 @@
 / SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /----------------------------------------------------------------------------*/
 #include <ctype.h>
+#include <errno.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "elmchan_impl.h"
 #include "elmchan/src/diskio.h"
 #include "elmchan/src/ff.h"
+#include "cache.h"
+#include "simg.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 struct FatType {
@@ -38,18 +44,161 @@ struct FatType {
 	BYTE id;
 };
 
+static struct FatType fs_types[] = {
+	{"any", FM_ANY} , {"fat", FM_FAT},
+	{"fat32", FM_FAT32}, {"exfat", FM_EXFAT},
+};
+
+static struct FatType *
+find_fs_type(const char *name) {
+	for (int i = 0; i < sizeof(fs_types) / sizeof(struct FatType); ++i) {
+		if (strcmp(name, fs_types[i].name) == 0) {
+			return &fs_types[i];
+		}
+	}
+	return NULL;
+}
+
 static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 static const char* fatfs_names[] = {"None", "FAT-12", "FAT-16", "FAT-32", "ExFAT"};
 
 int main(int argc, const char *argv[]) {
-	const char *image_path = argv[1];
-	const char *action = argv[2];
+	const char *prog = basename((char *)argv[0]);
+	struct fatboy_image_opts opts = {
+		.backend = FATBOY_BACKEND_FILE,
+		.cache_bytes = 0,
+		.readahead_bytes = 1024 * 1024,
+		.coalesce_bytes = 4 * 1024 * 1024,
+		.uring_depth = 32,
+		.memory_bytes = 1024ULL * 1024 * 1024,
+		.sync_policy = FATBOY_SYNC_NONE,
+		.sync_ops = 64,
+		.sync_bytes = 64 * 1024 * 1024,
+	};
+	int cache_stats = 0;
+	int stats = 0;
+	const char *stats_json = NULL;
+	const char *trace_path = NULL;
+	int sparse = 0;
+	int created = 0;
 	FATFS fs;
 	int32_t ret;
 	int exit_code = 0;
 
+	// options come before the image and are consumed so the positional arguments stay put
+	while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--mmap") == 0) {
+			opts.backend = FATBOY_BACKEND_MMAP;
+		} else if (strcmp(argv[1], "--io-uring") == 0) {
+			opts.backend = FATBOY_BACKEND_URING;
+		} else if (strcmp(argv[1], "--memory") == 0) {
+			opts.backend = FATBOY_BACKEND_MEMORY;
+		} else if (strcmp(argv[1], "--memory-mb") == 0 && argc > 2) {
+			opts.memory_bytes = (uint64_t)strtoul(argv[2], NULL, 10) * 1024 * 1024;
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--direct") == 0) {
+			opts.direct = 1;
+		} else if (strcmp(argv[1], "--sector-size") == 0 && argc > 2) {
+			opts.sector_size = (unsigned)strtoul(argv[2], NULL, 10);
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--partition") == 0 && argc > 2) {
+			opts.partition = (unsigned)strtoul(argv[2], NULL, 10);
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--sync") == 0 && argc > 2) {
+			if (strcmp(argv[2], "none") == 0) {
+				opts.sync_policy = FATBOY_SYNC_NONE;
+			} else if (strcmp(argv[2], "batch") == 0) {
+				opts.sync_policy = FATBOY_SYNC_BATCH;
+			} else if (strcmp(argv[2], "strict") == 0) {
+				opts.sync_policy = FATBOY_SYNC_STRICT;
+			} else {
+				printf("Unknown sync policy '%s'\n", argv[2]);
+				return -1;
+			}
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--sync-ops") == 0 && argc > 2) {
+			opts.sync_ops = (unsigned)strtoul(argv[2], NULL, 10);
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--sync-mb") == 0 && argc > 2) {
+			opts.sync_bytes = (uint64_t)strtoul(argv[2], NULL, 10) * 1024 * 1024;
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--transaction") == 0) {
+			opts.transaction = 1;
+		} else if (strcmp(argv[1], "--overlay") == 0 && argc > 2) {
+			opts.overlay = argv[2];
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--queue-depth") == 0 && argc > 2) {
+			opts.uring_depth = (unsigned)strtoul(argv[2], NULL, 10);
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--cache-mb") == 0 && argc > 2) {
+			opts.cache_bytes = (size_t)strtoul(argv[2], NULL, 10) * 1024 * 1024;
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--readahead-kb") == 0 && argc > 2) {
+			opts.readahead_bytes = (size_t)strtoul(argv[2], NULL, 10) * 1024;
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--write-combine-kb") == 0 && argc > 2) {
+			opts.coalesce_bytes = (size_t)strtoul(argv[2], NULL, 10) * 1024;
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--cache-stats") == 0) {
+			cache_stats = 1;
+		} else if (strcmp(argv[1], "--stats") == 0) {
+			stats = 1;
+		} else if (strcmp(argv[1], "--trace-io") == 0 && argc > 2) {
+			trace_path = argv[2];
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--stats-json") == 0 && argc > 2) {
+			stats_json = argv[2];
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--sparse") == 0) {
+			sparse = 1;
+		} else {
+			printf("Unknown option '%s'\n", argv[1]);
+			return -1;
+		}
+		argv++;
+		argc--;
+	}
+
+	const char *image_path = argv[1];
+	const char *action = argv[2];
+
 	if (argc < 3) {
-		printf("Usage: %s <image> <action> <parameters>\n", basename((char *)argv[0]));
+		printf("Usage: %s [options] <image> <action> <parameters>\n", prog);
+		printf("Options:\n");
+		printf("\t--mmap - access the image through a shared memory mapping\n");
+		printf("\t--io-uring - keep several reads and writes in flight with io_uring (Linux)\n");
+		printf("\t--memory - work on the image in memory and write the changes back once at exit\n");
+		printf("\t--memory-mb <size> - largest image --memory loads, bigger ones are used in place (default 1024)\n");
+		printf("\t--direct - bypass the page cache with aligned O_DIRECT transfers\n");
+		printf("\t--sector-size <bytes> - 512, 1024, 2048 or 4096 byte sectors for images (default: detect)\n");
+		printf("\t--partition <n> - use partition n of an MBR or GPT disk image, also given as <image>@p<n>\n");
+		printf("\t--sync <none, batch, strict> - flush the image only at exit, every few syncs or on every file closed (default none)\n");
+		printf("\t--sync-ops <n> - batch: flush after this many syncs (default 64)\n");
+		printf("\t--sync-mb <size> - batch: flush after this many MiB written (default 64)\n");
+		printf("\t--transaction - journal all changes and apply them to the image at once when done\n");
+		printf("\t--overlay <delta_file> - leave the image untouched and keep all changes in the delta file\n");
+		printf("\t--queue-depth <n> - io_uring requests in flight (default 32)\n");
+		printf("\t--cache-mb <size> - keep a write-back cache of this many MiB of image sectors\n");
+		printf("\t--cache-stats - print sector cache hit and miss counters on exit\n");
+		printf("\t--stats - print disk I/O counters and timing on exit\n");
+		printf("\t--trace-io <file> - record every disk read, write and ioctl to a trace file for replay\n");
+		printf("\t--stats-json <file> - write the --stats counters to a file as JSON, - for stdout\n");
+		printf("\t--readahead-kb <size> - largest window read ahead of sequential reads, 0 disables (default 1024)\n");
+		printf("\t--write-combine-kb <size> - writes held back to merge adjacent sectors, 0 disables (default 4096)\n");
+		printf("\t--sparse - extract and extractdir leave holes in host files where the data is all zeros\n");
 		printf("Actions:\n");
 		printf("\tls <path> - print a file listing for an optional path\n");
 		printf("\trm <path> - remove a file from the image\n");
@@ -60,15 +209,48 @@ int main(int argc, const char *argv[]) {
 		printf("\tmkdir <image_path> - make a directory\n");
 		printf("\tmkfs <fat, fat32, exfat, any> (<power of 2 allocation unit>) - make a new filesystem with an optional allocation unit size\n");
 		printf("\tsetlabel <label> - set FS label\n");
+		printf("\tsimg <host_file> - write the image as an Android sparse image with free clusters left out\n");
+		printf("\texport <host_file> - write the image, with any --overlay changes merged in, to a new sparse file\n");
+		printf("\treplay <trace_file> (timed) (destructive) - repeat the disk accesses of a --trace-io trace on the image as fast as possible or with the original timing; traces that write need --overlay, or destructive to store filler data in the image\n");
+		printf("\tapplydelta <delta_file> - write the changes kept in an --overlay delta file into the image\n");
+		printf("\tcreate <size> <fat, fat32, exfat, any> (<power of 2 allocation unit>) - create a sparse image of the given size (K, M, G or T suffix) and make a filesystem on it\n");
 		return -1;
 	}
 
-	ret = fatboy_set_image(image_path);
+	// create makes the image file, then it is formatted exactly like mkfs
+	if (strcmp(action, "create") == 0) {
+		if (argc < 4) {
+			printf("Image size not specified\n");
+			return -1;
+		}
+		// check what mkfs will be asked before there is a file to clean up
+		if (argc > 4 && !find_fs_type(argv[4])) {
+			printf("Invalid fs type '%s'\n", argv[4]);
+			return -1;
+		}
+		if (create_image(image_path, argv[3], opts.sector_size ? opts.sector_size : FATBOY_SECTOR_SIZE) != 0) {
+			return -1;
+		}
+		created = 1;
+		action = "mkfs";
+		argv++;
+		argc--;
+	}
+
+	ret = fatboy_set_image(image_path, &opts);
 	if (ret != 0) {
 		printf("Error %d opening FAT image '%s'\n", ret, image_path);
+		if (created) {
+			unlink(image_path);
+		}
 		return -1;
 	}
 
+	if (trace_path && trace_open(trace_path) != 0) {
+		exit_code = -1;
+		goto exit;
+	}
+
 	// MKFS needs to hapen before we try and mount the partition
 	if (strcmp(action, "mkfs") == 0) {
 		FRESULT res;
@@ -78,19 +260,9 @@ int main(int argc, const char *argv[]) {
 		const char *fat_arg = argv[3];
 		const char *alloc_arg = argv[4];
 		struct FatType *selected = NULL;
-		struct FatType fs_types[] = {
-			{"any", FM_ANY} , {"fat", FM_FAT},
-			{"fat32", FM_FAT32}, {"exfat", FM_EXFAT},
-		};
 
 		if (argc > 3) {
-			for (int i = 0; i < sizeof(fs_types) / sizeof(struct FatType); ++i) {
-				if (strcmp(fat_arg, fs_types[i].name) == 0) {
-					selected = &fs_types[i];
-					break;
-				}
-			}
-
+			selected = find_fs_type(fat_arg);
 			if (selected == NULL) {
 				printf("Invalid fs type '%s'\n", fat_arg);
 				exit_code = -1;
@@ -115,7 +287,8 @@ int main(int argc, const char *argv[]) {
 			goto exit;
 		}
 
-		res = f_mkfs("", selected->id, alloc_unit, work, work_len);
+		// a partition gets the volume itself, not a partition table of its own
+		res = f_mkfs("", selected->id | (fatboy_partition() ? FM_SFD : 0), alloc_unit, work, work_len);
 
 		free(work);
 		work = NULL;
@@ -129,10 +302,56 @@ int main(int argc, const char *argv[]) {
 		action = "info";
 	}
 
+	// these work on the raw sectors, the file system is not mounted
+	if (strcmp(action, "export") == 0) {
+		if (!argv[3]) {
+			printf("Output file not specified\n");
+			exit_code = -1;
+		} else if (fatboy_export_image(argv[3]) != 0) {
+			exit_code = -1;
+		}
+		goto exit;
+	} else if (strcmp(action, "replay") == 0) {
+		if (!argv[3]) {
+			printf("Trace file not specified\n");
+			exit_code = -1;
+		} else {
+			int timed = 0, destructive = opts.overlay != NULL;
+
+			// an overlay keeps the filler the writes store out of the image
+			for (int i = 4; i < argc; i++) {
+				if (strcmp(argv[i], "timed") == 0) {
+					timed = 1;
+				} else if (strcmp(argv[i], "destructive") == 0) {
+					destructive = 1;
+				} else {
+					printf("Unknown replay argument '%s'\n", argv[i]);
+					exit_code = -1;
+					goto exit;
+				}
+			}
+			if (trace_replay(argv[3], timed, destructive) != 0) {
+				exit_code = -1;
+			}
+		}
+		goto exit;
+	} else if (strcmp(action, "applydelta") == 0) {
+		if (!argv[3]) {
+			printf("Delta file not specified\n");
+			exit_code = -1;
+		} else if (fatboy_apply_delta(argv[3]) != 0) {
+			exit_code = -1;
+		}
+		goto exit;
+	}
+
 	// mount the partition for use by other commands
+	stats_attach(&fs);
 	ret = f_mount(&fs, "", 1);
 	if (ret != FR_OK) {
 		printf("Error mounting volume: %s\n", fr_res_to_str(ret));
+		fatboy_close_image();
+		trace_close();
 		return -1;
 	}
 
@@ -237,7 +456,12 @@ int main(int argc, const char *argv[]) {
 			}
 		}
 		fclose(fin);
-		f_close(&fp);
+		// with write-behind, writes that failed are only reported here
+		res = f_close(&fp);
+		if (res != FR_OK) {
+			printf("Error: closing '%s' failed: %s\n", fat_file, fr_res_to_str(res));
+			exit_code = -1;
+		}
 
 	} else if (strcmp(action, "extract") == 0) {
 		const char *fat_file = argv[3];
@@ -272,13 +496,17 @@ int main(int argc, const char *argv[]) {
 			goto exit;
 		}
 
-		exit_code = write_file(&fp, out);
+		exit_code = write_file(&fp, out, sparse);
 		if (exit_code != 0) {
 			goto exit;
 		}
 
 		fclose(out);
-		f_close(&fp);
+		res = f_close(&fp);
+		if (res != FR_OK) {
+			printf("Error: closing '%s' failed: %s\n", fat_file, fr_res_to_str(res));
+			exit_code = -1;
+		}
 
 	} else if (strcmp(action, "info") == 0) {
 		FRESULT res;
@@ -298,8 +526,8 @@ int main(int argc, const char *argv[]) {
 			printf("Error getting free space: %s\n", fr_res_to_str(res));
 		} else {
 			printf("FS type: %s\n", fatfs_names[fatfs->fs_type]);
-			printf("Free space: %lu KiB\n", clusters * fatfs->csize * FATBOY_SECTOR_SIZE / 1024);
-			printf("Capacity:   %lu KiB\n", (fatfs->n_fatent -2) * fatfs->csize * FATBOY_SECTOR_SIZE / 1024);
+			printf("Free space: %llu KiB\n", (unsigned long long)clusters * fatfs->csize * fatfs->ssize / 1024);
+			printf("Capacity:   %llu KiB\n", (unsigned long long)(fatfs->n_fatent -2) * fatfs->csize * fatfs->ssize / 1024);
 		}
 
 	} else if (strcmp(action, "mkdir") == 0) {
@@ -395,7 +623,7 @@ int main(int argc, const char *argv[]) {
 					goto exit;
 				}
 
-				exit_code = write_file(&fp, out);
+				exit_code = write_file(&fp, out, sparse);
 				if (exit_code != 0) {
 					goto exit;
 				}
@@ -404,11 +632,52 @@ int main(int argc, const char *argv[]) {
 		} else {
 			printf("Couldn't open '%s' to list\n", img_path);
 		}
+	} else if (strcmp(action, "simg") == 0) {
+		if (!argv[3]) {
+			printf("Sparse image file not specified\n");
+			exit_code = -1;
+			goto exit;
+		}
+		if (simg_export(&fs, argv[3]) != 0) {
+			exit_code = -1;
+		}
 	} else {
 		printf("Invalid action '%s'\n", action);
 	}
 
 exit:
 	f_mount(NULL, "", 0);
+	if (fatboy_close_image() != 0) {
+		printf("Error: not all changes could be written to '%s'\n", image_path);
+		exit_code = -1;
+	}
+	trace_close();
+	if (created && exit_code != 0) {
+		// do not leave an unformatted image behind
+		unlink(image_path);
+	}
+	if (cache_stats) {
+		struct cache_stats st;
+		cache_get_stats(&st);
+		printf("Cache: %llu hits, %llu misses, %llu writebacks, %llu evictions\n",
+				(unsigned long long)st.hits, (unsigned long long)st.misses,
+				(unsigned long long)st.writebacks, (unsigned long long)st.evictions);
+	}
+	if (stats) {
+		stats_print(stdout, 0);
+	}
+	if (stats_json) {
+		FILE *out = strcmp(stats_json, "-") == 0 ? stdout : fopen(stats_json, "w");
+
+		if (!out) {
+			printf("ERROR: could not write '%s': %s\n", stats_json, strerror(errno));
+			exit_code = -1;
+		} else {
+			stats_print(out, 1);
+			if (out != stdout) {
+				fclose(out);
+			}
+		}
+	}
 	return exit_code;
 }
@@ -0,0 +1,385 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "elmchan/src/diskio.h"
+#include "simg.h"
+
+#define SIMG_RUN_BYTES	(1024 * 1024)	// data handled per read while exporting
+
+static void
+simg_put_le16(BYTE *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void
+simg_put_le32(BYTE *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static int
+simg_pwrite(struct simg_writer *w, const void *buf, size_t len, off_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pwrite(w->fd, (const BYTE *)buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			printf("Error: writing the sparse image failed: %s\n", strerror(errno));
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int
+simg_finish_chunk(struct simg_writer *w) {
+	BYTE hdr[SIMG_CHUNK_HDR_SZ + 4];
+	size_t len = SIMG_CHUNK_HDR_SZ;
+	uint32_t total = SIMG_CHUNK_HDR_SZ;
+
+	if (!w->type) {
+		return 0;
+	}
+	if (w->type == SIMG_CHUNK_RAW) {
+		total += w->chunk_blks * w->blk_sz;
+	} else if (w->type == SIMG_CHUNK_FILL) {
+		simg_put_le32(hdr + SIMG_CHUNK_HDR_SZ, w->fill);
+		total += 4;
+		len += 4;
+	}
+	simg_put_le16(hdr, w->type);
+	simg_put_le16(hdr + 2, 0);
+	simg_put_le32(hdr + 4, w->chunk_blks);
+	simg_put_le32(hdr + 8, total);
+
+	w->type = 0;
+	w->n_chunks++;
+	return simg_pwrite(w, hdr, len, w->chunk_off);
+}
+
+/* Make sure a chunk of the given kind is open with room left, returns the room */
+static uint32_t
+simg_begin_chunk(struct simg_writer *w, uint16_t type, uint32_t fill) {
+	// a raw chunk's byte size has to fit its 32-bit length field
+	uint32_t max = type == SIMG_CHUNK_RAW ? (UINT32_MAX - SIMG_CHUNK_HDR_SZ) / w->blk_sz : UINT32_MAX;
+
+	if (w->type != type || (type == SIMG_CHUNK_FILL && w->fill != fill) || w->chunk_blks == max) {
+		if (simg_finish_chunk(w) != 0) {
+			return 0;
+		}
+		w->type = type;
+		w->fill = fill;
+		w->chunk_blks = 0;
+		w->chunk_off = w->pos;
+		w->pos += SIMG_CHUNK_HDR_SZ + (type == SIMG_CHUNK_FILL ? 4 : 0);
+	}
+	return max - w->chunk_blks;
+}
+
+/* Write to a file that is already open and empty, the writer closes it */
+int
+simg_writer_open_fd(struct simg_writer *w, int fd, uint32_t blk_sz, uint32_t total_blks) {
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->blk_sz = blk_sz;
+	w->total_blks = total_blks;
+	w->pos = SIMG_FILE_HDR_SZ;
+	return 0;
+}
+
+/* Create path, which must not exist yet */
+int
+simg_writer_open(struct simg_writer *w, const char *path, uint32_t blk_sz, uint32_t total_blks) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+	if (fd < 0 && errno == EEXIST) {
+		printf("Error: '%s' already exists\n", path);
+		return -1;
+	}
+	if (fd < 0) {
+		printf("Error: couldn't create '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	return simg_writer_open_fd(w, fd, blk_sz, total_blks);
+}
+
+int
+simg_writer_raw(struct simg_writer *w, const BYTE *data, uint32_t n_blks) {
+	while (n_blks > 0) {
+		uint32_t n = simg_begin_chunk(w, SIMG_CHUNK_RAW, 0);
+		if (n == 0) {
+			return -1;
+		}
+		if (n > n_blks) {
+			n = n_blks;
+		}
+		if (simg_pwrite(w, data, (size_t)n * w->blk_sz, w->pos) != 0) {
+			return -1;
+		}
+		w->pos += (off_t)n * w->blk_sz;
+		w->chunk_blks += n;
+		w->blocks += n;
+		data += (size_t)n * w->blk_sz;
+		n_blks -= n;
+	}
+	return 0;
+}
+
+static int
+simg_writer_run(struct simg_writer *w, uint16_t type, uint32_t fill, uint32_t n_blks) {
+	while (n_blks > 0) {
+		uint32_t n = simg_begin_chunk(w, type, fill);
+		if (n == 0) {
+			return -1;
+		}
+		if (n > n_blks) {
+			n = n_blks;
+		}
+		w->chunk_blks += n;
+		w->blocks += n;
+		n_blks -= n;
+	}
+	return 0;
+}
+
+int
+simg_writer_fill(struct simg_writer *w, uint32_t fill, uint32_t n_blks) {
+	return simg_writer_run(w, SIMG_CHUNK_FILL, fill, n_blks);
+}
+
+int
+simg_writer_skip(struct simg_writer *w, uint32_t n_blks) {
+	return simg_writer_run(w, SIMG_CHUNK_DONT_CARE, 0, n_blks);
+}
+
+/* Blocks that repeat one 32-bit value become fill chunks, the rest raw data */
+int
+simg_writer_data(struct simg_writer *w, const BYTE *data, uint32_t n_blks) {
+	uint32_t raw = 0;
+
+	for (uint32_t i = 0; i < n_blks; i++) {
+		const BYTE *blk = data + (size_t)i * w->blk_sz;
+
+		if (memcmp(blk, blk + 4, w->blk_sz - 4) != 0) {
+			raw++;
+			continue;
+		}
+		if (simg_writer_raw(w, blk - (size_t)raw * w->blk_sz, raw) != 0
+				|| simg_writer_fill(w, simg_le32(blk), 1) != 0) {
+			return -1;
+		}
+		raw = 0;
+	}
+	return simg_writer_raw(w, data + (size_t)(n_blks - raw) * w->blk_sz, raw);
+}
+
+int
+simg_writer_close(struct simg_writer *w) {
+	BYTE hdr[SIMG_FILE_HDR_SZ];
+	int ret;
+
+	ret = simg_finish_chunk(w);
+	if (ret == 0 && w->blocks != w->total_blks) {
+		printf("Error: sparse image has %u of %u blocks\n", w->blocks, w->total_blks);
+		ret = -1;
+	}
+	if (ret == 0) {
+		simg_put_le32(hdr, SIMG_MAGIC);
+		simg_put_le16(hdr + 4, 1);		// major version
+		simg_put_le16(hdr + 6, 0);		// minor version
+		simg_put_le16(hdr + 8, SIMG_FILE_HDR_SZ);
+		simg_put_le16(hdr + 10, SIMG_CHUNK_HDR_SZ);
+		simg_put_le32(hdr + 12, w->blk_sz);
+		simg_put_le32(hdr + 16, w->total_blks);
+		simg_put_le32(hdr + 20, w->n_chunks);
+		simg_put_le32(hdr + 24, 0);		// no image checksum
+		ret = simg_pwrite(w, hdr, sizeof(hdr), 0);
+	}
+	if (ret == 0 && w->sync && fsync(w->fd) != 0) {
+		printf("Error: flushing the sparse image failed: %s\n", strerror(errno));
+		ret = -1;
+	}
+	if (close(w->fd) != 0 && ret == 0) {
+		printf("Error: closing the sparse image failed: %s\n", strerror(errno));
+		ret = -1;
+	}
+	w->fd = -1;
+	return ret;
+}
+
+/*
+ * Mark the clusters in use. exFAT keeps an allocation bitmap at the start
+ * of the cluster heap, the FAT variants have a non-zero FAT entry for every
+ * allocated cluster.
+ */
+static BYTE *
+simg_cluster_map(FATFS *fs) {
+	UINT ss = fs->ssize;
+	DWORD n_clst = fs->n_fatent - 2;
+	size_t map_len = (n_clst + 7) / 8;
+	LBA_t n_sect;
+	BYTE *map, *buf;
+
+	n_sect = fs->fs_type == FS_EXFAT ? (map_len + ss - 1) / ss : fs->fsize;
+	map = calloc(1, map_len);
+	buf = malloc((size_t)n_sect * ss);
+	if (!map || !buf) {
+		printf("Error: out of memory reading the allocation table\n");
+		goto fail;
+	}
+	for (LBA_t done = 0; done < n_sect; ) {
+		UINT n = n_sect - done > 128 ? 128 : (UINT)(n_sect - done);
+		LBA_t base = fs->fs_type == FS_EXFAT ? fs->database : fs->fatbase;
+		if (disk_read(fs->drv, buf + (size_t)done * ss, base + done, n) != RES_OK) {
+			printf("Error: reading the allocation table failed\n");
+			goto fail;
+		}
+		done += n;
+	}
+
+	if (fs->fs_type == FS_EXFAT) {
+		memcpy(map, buf, map_len);
+	} else {
+		for (DWORD c = 2; c < fs->n_fatent; c++) {
+			DWORD val;
+			if (fs->fs_type == FS_FAT12) {
+				DWORD bc = c + c / 2;
+				val = buf[bc] | buf[bc + 1] << 8;
+				val = c & 1 ? val >> 4 : val & 0xFFF;
+			} else if (fs->fs_type == FS_FAT16) {
+				val = simg_le16(buf + c * 2);
+			} else {
+				val = simg_le32(buf + c * 4) & 0x0FFFFFFF;
+			}
+			if (val) {
+				map[(c - 2) / 8] |= 1 << ((c - 2) % 8);
+			}
+		}
+	}
+	free(buf);
+	return map;
+
+fail:
+	free(map);
+	free(buf);
+	return NULL;
+}
+
+/* Does a run of sectors hold anything but free clusters? */
+static int
+simg_in_use(FATFS *fs, const BYTE *map, LBA_t s0, LBA_t s1) {
+	LBA_t data_end = fs->database + (LBA_t)(fs->n_fatent - 2) * fs->csize;
+
+	if (s0 < fs->database || s1 > data_end) {
+		return 1;	// boot sectors, FATs, root directory or the unused tail
+	}
+	for (DWORD c = (s0 - fs->database) / fs->csize; c <= (s1 - 1 - fs->database) / fs->csize; c++) {
+		if (map[c / 8] & (1 << (c % 8))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the whole image as a sparse image. Free clusters become don't
+ * care chunks, so the result and the time to flash it scale with the data
+ * actually stored rather than with the size of the volume.
+ */
+int
+simg_export(FATFS *fs, const char *path) {
+	struct simg_writer w;
+	UINT ss = fs->ssize;
+	LBA_t n_sect;
+	uint64_t bytes;
+	uint32_t blk_sz, spb, total_blks;
+	BYTE *map, *buf;
+	int ret = 0;
+
+	if (disk_ioctl(fs->drv, GET_SECTOR_COUNT, &n_sect) != RES_OK) {
+		return -1;
+	}
+	bytes = (uint64_t)n_sect * ss;
+	blk_sz = bytes % 4096 == 0 ? 4096 : ss;
+	spb = blk_sz / ss;
+	if (bytes / blk_sz > UINT32_MAX) {
+		printf("Error: the image is too large for a sparse image\n");
+		return -1;
+	}
+	total_blks = bytes / blk_sz;
+
+	map = simg_cluster_map(fs);
+	buf = malloc(SIMG_RUN_BYTES);
+	if (!map || !buf || simg_writer_open(&w, path, blk_sz, total_blks) != 0) {
+		free(map);
+		free(buf);
+		return -1;
+	}
+
+	for (uint32_t blk = 0; blk < total_blks && ret == 0; ) {
+		int used = simg_in_use(fs, map, (LBA_t)blk * spb, (LBA_t)(blk + 1) * spb);
+		uint32_t n = 1;
+
+		while (blk + n < total_blks && n < SIMG_RUN_BYTES / blk_sz
+				&& simg_in_use(fs, map, (LBA_t)(blk + n) * spb, (LBA_t)(blk + n + 1) * spb) == used) {
+			n++;
+		}
+		if (!used) {
+			ret = simg_writer_skip(&w, n);
+		} else if (disk_read(fs->drv, buf, (LBA_t)blk * spb, n * spb) != RES_OK) {
+			printf("Error: reading the image failed\n");
+			ret = -1;
+		} else {
+			ret = simg_writer_data(&w, buf, n);
+		}
+		blk += n;
+	}
+
+	if (simg_writer_close(&w) != 0) {
+		ret = -1;
+	}
+	// the file was created above, a partial sparse image is of no use
+	if (ret != 0) {
+		unlink(path);
+	} else {
+		printf("Wrote %u blocks of %u bytes in %u chunks to '%s'\n", total_blks, blk_sz, w.n_chunks, path);
+	}
+	free(map);
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,81 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "elmchan/src/ff.h"
+
+/*
+ * Android sparse image format, as consumed by fastboot. A file header is
+ * followed by chunks that each describe a run of blocks: raw data, a
+ * repeated 32-bit fill value, or "don't care" for blocks whose contents do
+ * not matter. All fields are little endian.
+ */
+
+#define SIMG_MAGIC		0xED26FF3A
+#define SIMG_FILE_HDR_SZ	28
+#define SIMG_CHUNK_HDR_SZ	12
+
+#define SIMG_CHUNK_RAW		0xCAC1
+#define SIMG_CHUNK_FILL		0xCAC2
+#define SIMG_CHUNK_DONT_CARE	0xCAC3
+#define SIMG_CHUNK_CRC32	0xCAC4
+
+static inline uint32_t
+simg_le16(const BYTE *p) {
+	return p[0] | p[1] << 8;
+}
+
+static inline uint32_t
+simg_le32(const BYTE *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Streams chunks into a new sparse image, merging runs of the same kind */
+struct simg_writer {
+	int fd;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t blocks;	// blocks emitted so far
+	uint32_t n_chunks;
+	uint16_t type;		// chunk being built, 0 if none
+	uint32_t chunk_blks;
+	uint32_t fill;
+	off_t chunk_off;	// where its header goes
+	off_t pos;		// end of the file
+	int sync;		// fsync before closing, the file is about to replace another
+};
+
+int simg_writer_open(struct simg_writer *w, const char *path, uint32_t blk_sz, uint32_t total_blks);
+int simg_writer_open_fd(struct simg_writer *w, int fd, uint32_t blk_sz, uint32_t total_blks);
+int simg_writer_raw(struct simg_writer *w, const BYTE *data, uint32_t n_blks);
+int simg_writer_fill(struct simg_writer *w, uint32_t fill, uint32_t n_blks);
+int simg_writer_skip(struct simg_writer *w, uint32_t n_blks);
+int simg_writer_data(struct simg_writer *w, const BYTE *data, uint32_t n_blks);
+int simg_writer_close(struct simg_writer *w);
+
+int simg_export(FATFS *fs, const char *path);
@@ -0,0 +1,154 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "stats.h"
+
+struct io_stats io_stats;
+
+static const FATFS *volume;
+static int forced_class = -1;
+static const char *class_names[IO_CLASSES] = { "fat", "dir", "data" };
+
+uint64_t
+stats_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+stats_attach(const FATFS *fs) {
+	volume = fs;
+}
+
+enum io_class
+stats_class(const BYTE *buff, LBA_t sector) {
+	const FATFS *fs = volume;
+
+	if (forced_class >= 0) {
+		return forced_class;
+	}
+	// the layout is only valid once the mount has finished
+	if (!fs || !fs->fs_type) {
+		return IO_CLASS_DATA;
+	}
+	if (sector >= fs->fatbase && sector < fs->fatbase + (LBA_t)fs->fsize * fs->n_fats) {
+		return IO_CLASS_FAT;
+	}
+	if (buff == fs->win) {
+		return IO_CLASS_DIR;
+	}
+	// the FAT12/16 root directory has its own area before the data
+	if ((fs->fs_type == FS_FAT12 || fs->fs_type == FS_FAT16) && sector >= fs->dirbase && sector < fs->database) {
+		return IO_CLASS_DIR;
+	}
+	return IO_CLASS_DATA;
+}
+
+const char *
+stats_class_name(enum io_class class) {
+	return class < IO_CLASSES ? class_names[class] : "?";
+}
+
+int
+stats_class_by_name(const char *name) {
+	for (int i = 0; i < IO_CLASSES; i++) {
+		if (strcmp(name, class_names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void
+stats_force_class(int class) {
+	forced_class = class;
+}
+
+// peak resident set size in KiB
+static uint64_t
+peak_rss_kb(void) {
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return (uint64_t)ru.ru_maxrss / 1024;	// bytes on macOS
+#else
+	return (uint64_t)ru.ru_maxrss;
+#endif
+}
+
+void
+stats_print(FILE *out, int json) {
+	const struct io_stats *st = &io_stats;
+	unsigned long long ss = st->sector_size;
+
+	if (json) {
+		fprintf(out, "{\"reads\": %llu, \"read_sectors\": %llu, \"read_bytes\": %llu, "
+				"\"writes\": %llu, \"write_sectors\": %llu, \"write_bytes\": %llu, "
+				"\"fat_sectors\": %llu, \"dir_sectors\": %llu, \"data_sectors\": %llu, "
+				"\"image_reads\": %llu, \"image_read_bytes\": %llu, "
+				"\"image_writes\": %llu, \"image_write_bytes\": %llu, "
+				"\"seeks\": %llu, \"syscalls\": %llu, \"syncs\": %llu, \"flushes\": %llu, \"trims\": %llu, "
+				"\"io_ns\": %llu, \"peak_rss_kb\": %llu}\n",
+				(unsigned long long)st->reads, (unsigned long long)st->read_sectors,
+				(unsigned long long)st->read_sectors * ss,
+				(unsigned long long)st->writes, (unsigned long long)st->write_sectors,
+				(unsigned long long)st->write_sectors * ss,
+				(unsigned long long)st->class_sectors[IO_CLASS_FAT],
+				(unsigned long long)st->class_sectors[IO_CLASS_DIR],
+				(unsigned long long)st->class_sectors[IO_CLASS_DATA],
+				(unsigned long long)st->image_reads, (unsigned long long)st->image_read_bytes,
+				(unsigned long long)st->image_writes, (unsigned long long)st->image_write_bytes,
+				(unsigned long long)st->seeks, (unsigned long long)st->syscalls,
+				(unsigned long long)st->syncs, (unsigned long long)st->flushes,
+				(unsigned long long)st->trims, (unsigned long long)st->io_ns,
+				(unsigned long long)peak_rss_kb());
+		return;
+	}
+
+	fprintf(out, "Disk reads:  %llu calls, %llu sectors, %llu bytes\n", (unsigned long long)st->reads,
+			(unsigned long long)st->read_sectors, (unsigned long long)st->read_sectors * ss);
+	fprintf(out, "Disk writes: %llu calls, %llu sectors, %llu bytes\n", (unsigned long long)st->writes,
+			(unsigned long long)st->write_sectors, (unsigned long long)st->write_sectors * ss);
+	fprintf(out, "Sectors:     %llu FAT, %llu directory, %llu data\n",
+			(unsigned long long)st->class_sectors[IO_CLASS_FAT],
+			(unsigned long long)st->class_sectors[IO_CLASS_DIR],
+			(unsigned long long)st->class_sectors[IO_CLASS_DATA]);
+	fprintf(out, "Image:       %llu reads of %llu bytes, %llu writes of %llu bytes, %llu seeks, %llu syscalls\n",
+			(unsigned long long)st->image_reads, (unsigned long long)st->image_read_bytes,
+			(unsigned long long)st->image_writes, (unsigned long long)st->image_write_bytes,
+			(unsigned long long)st->seeks, (unsigned long long)st->syscalls);
+	fprintf(out, "Syncs:       %llu, %llu flushed, %llu trims\n", (unsigned long long)st->syncs,
+			(unsigned long long)st->flushes, (unsigned long long)st->trims);
+	fprintf(out, "I/O time:    %.3f ms, peak RSS %llu KiB\n", st->io_ns / 1e6, (unsigned long long)peak_rss_kb());
+}
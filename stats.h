@@ -0,0 +1,70 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "elmchan/src/ff.h"
+
+// what the sectors of a disk access hold
+enum io_class {
+	IO_CLASS_FAT,	// the FATs
+	IO_CLASS_DIR,	// directories and other metadata read through the FatFs window
+	IO_CLASS_DATA,	// file contents, and everything before a volume is mounted
+	IO_CLASSES,
+};
+
+struct io_stats {
+	// FatFs requests, counted in diskio.c
+	uint64_t reads;		// disk_read calls
+	uint64_t writes;	// disk_write calls
+	uint64_t read_sectors;
+	uint64_t write_sectors;
+	uint64_t class_sectors[IO_CLASSES];	// sectors read or written, by what they hold
+	uint64_t syncs;		// CTRL_SYNC requests
+	uint64_t io_ns;		// wall time in disk I/O and closing the image
+	// image accesses, counted in elmchan_impl.c
+	uint64_t image_reads;
+	uint64_t image_writes;
+	uint64_t image_read_bytes;
+	uint64_t image_write_bytes;
+	uint64_t seeks;		// accesses not starting where the previous one ended
+	uint64_t flushes;	// syncs that made the image durable
+	uint64_t trims;
+	// counted by the backends
+	uint64_t syscalls;	// read, write, sync and discard system calls on the image
+	unsigned sector_size;	// file system sector size
+};
+
+extern struct io_stats io_stats;
+
+uint64_t stats_now_ns(void);
+void stats_attach(const FATFS *fs);	// classify accesses by the layout of fs once it is mounted
+enum io_class stats_class(const BYTE *buff, LBA_t sector);
+const char *stats_class_name(enum io_class class);
+int stats_class_by_name(const char *name);	// -1 if unknown
+void stats_force_class(int class);	// count every access as class, -1 to go by the layout again
+void stats_print(FILE *out, int json);
@@ -0,0 +1,215 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+#define TRACE_HEADER "# fatboy io trace, sector size %u\n"
+
+static FILE *trace;
+static uint64_t trace_start;
+
+int
+trace_open(const char *path) {
+	trace = fopen(path, "w");
+	if (!trace) {
+		printf("ERROR: could not create trace '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	// a line is written for every disk access, keep that off the I/O path
+	setvbuf(trace, NULL, _IOFBF, 1024 * 1024);
+	fprintf(trace, TRACE_HEADER, io_stats.sector_size);
+	trace_start = stats_now_ns();
+	return 0;
+}
+
+void
+trace_close(void) {
+	if (trace && fclose(trace) != 0) {
+		printf("ERROR: writing the trace failed: %s\n", strerror(errno));
+	}
+	trace = NULL;
+}
+
+void
+trace_rw(char op, LBA_t sector, UINT count, enum io_class class, uint64_t start_ns) {
+	if (!trace) {
+		return;
+	}
+	fprintf(trace, "%llu %c %llu %u %s\n", (unsigned long long)(start_ns - trace_start), op,
+			(unsigned long long)sector, count, stats_class_name(class));
+}
+
+void
+trace_ioctl(BYTE cmd, const void *buff, uint64_t start_ns) {
+	unsigned long long ts;
+
+	if (!trace) {
+		return;
+	}
+	ts = (unsigned long long)(start_ns - trace_start);
+	if (cmd == CTRL_SYNC) {
+		fprintf(trace, "%llu S 0 0 -\n", ts);
+	} else if (cmd == CTRL_TRIM) {
+		const LBA_t *range = buff;
+
+		fprintf(trace, "%llu T %llu %llu -\n", ts, (unsigned long long)range[0], (unsigned long long)range[1]);
+	} else {
+		fprintf(trace, "%llu Q %u 0 -\n", ts, cmd);
+	}
+}
+
+static void
+wait_until(uint64_t when_ns) {
+	uint64_t now = stats_now_ns();
+	struct timespec ts;
+
+	if (now >= when_ns) {
+		return;
+	}
+	ts.tv_sec = (when_ns - now) / 1000000000;
+	ts.tv_nsec = (when_ns - now) % 1000000000;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+int
+trace_replay(const char *path, int timed, int destructive) {
+	FILE *in;
+	char line[256];
+	BYTE *buf = NULL;
+	size_t buf_len = 0;
+	WORD ss = 0;
+	unsigned trace_ss = 0;
+	unsigned long lineno = 0;
+	uint64_t ops = 0, failed = 0, start;
+	int ret = 0;
+
+	in = fopen(path, "r");
+	if (!in) {
+		printf("ERROR: could not open trace '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (disk_ioctl(0, GET_SECTOR_SIZE, &ss) != RES_OK) {
+		fclose(in);
+		return -1;
+	}
+
+	// look for anything that changes the image before touching it
+	if (!destructive) {
+		while (fgets(line, sizeof(line), in)) {
+			unsigned long long ts;
+			char op;
+
+			if (sscanf(line, "%llu %c", &ts, &op) == 2 && (op == 'W' || op == 'T')) {
+				printf("ERROR: trace '%s' writes to the image, replay it with --overlay or add 'destructive'\n", path);
+				fclose(in);
+				return -1;
+			}
+		}
+		rewind(in);
+	}
+
+	start = stats_now_ns();
+	while (fgets(line, sizeof(line), in)) {
+		unsigned long long ts, a, b;
+		char op, class[16];
+		DRESULT res;
+
+		lineno++;
+		if (line[0] == '#') {
+			// the sector numbers only mean the same thing at the same sector size
+			if (sscanf(line, TRACE_HEADER, &trace_ss) == 1 && trace_ss != ss) {
+				printf("ERROR: trace has %u byte sectors, the image %u\n", trace_ss, (unsigned)ss);
+				ret = -1;
+				goto out;
+			}
+			continue;
+		}
+		if (sscanf(line, "%llu %c %llu %llu %15s", &ts, &op, &a, &b, class) != 5) {
+			printf("ERROR: line %lu of trace '%s' is not valid\n", lineno, path);
+			ret = -1;
+			goto out;
+		}
+		if (timed) {
+			wait_until(start + ts);
+		}
+
+		switch (op) {
+			case 'R':
+			case 'W':
+				if (b * ss > buf_len) {
+					BYTE *nbuf = realloc(buf, b * ss);
+
+					if (!nbuf) {
+						printf("ERROR: no memory for a %llu sector transfer\n", b);
+						ret = -1;
+						goto out;
+					}
+					// writes store this filler, or whatever was read last
+					memset(nbuf + buf_len, 0xA5, b * ss - buf_len);
+					buf = nbuf;
+					buf_len = b * ss;
+				}
+				// the volume is not mounted, --stats goes by the recorded class
+				stats_force_class(stats_class_by_name(class));
+				res = op == 'R' ? disk_read(0, buf, a, (UINT)b) : disk_write(0, buf, a, (UINT)b);
+				break;
+			case 'S':
+				res = disk_ioctl(0, CTRL_SYNC, NULL);
+				break;
+			case 'T': {
+				LBA_t range[2] = { a, b };
+
+				res = disk_ioctl(0, CTRL_TRIM, range);
+				break;
+			}
+			case 'Q': {
+				union { LBA_t lba; DWORD dword; WORD word; } answer;
+
+				res = disk_ioctl(0, (BYTE)a, &answer);
+				break;
+			}
+			default:
+				printf("ERROR: line %lu of trace '%s' has unknown operation '%c'\n", lineno, path, op);
+				ret = -1;
+				goto out;
+		}
+		ops++;
+		if (res != RES_OK) {
+			failed++;
+		}
+	}
+	printf("Replayed %llu operations in %.3f ms, %llu failed\n", (unsigned long long)ops,
+			(stats_now_ns() - start) / 1e6, (unsigned long long)failed);
+out:
+	stats_force_class(-1);
+	free(buf);
+	fclose(in);
+	return ret;
+}
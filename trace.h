@@ -0,0 +1,53 @@
+/*----------------------------------------------------------------------------/
+/  FatBoy - Simple FAT file system tool                                       /
+/-----------------------------------------------------------------------------/
+/
+/ Copyright (C) 2017, John Kelley
+/ All right reserved.
+/
+/ FatBoy is open source software. Redistribution and use of FatBoy in source
+/ and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition, and the following disclaimer.
+/
+/ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+/ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+/ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+/ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+/ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+/ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+/ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+/ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+/ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+/ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/----------------------------------------------------------------------------*/
+#pragma once
+
+#include <stdint.h>
+#include "elmchan/src/diskio.h"
+#include "stats.h"
+
+/*
+ * I/O traces record every disk_read, disk_write and disk_ioctl FatFs
+ * makes, one text line each:
+ *
+ *	<ns since start> <op> <a> <b> <class>
+ *
+ * R and W read or write b sectors from sector a, S is a sync, T trims
+ * sectors a to b inclusive and Q is any other ioctl, command a. The
+ * class is fat, dir or data for reads and writes and - otherwise. Only
+ * where the I/O went is kept, never the data.
+ */
+int trace_open(const char *path);
+void trace_close(void);
+void trace_rw(char op, LBA_t sector, UINT count, enum io_class class, uint64_t start_ns);
+void trace_ioctl(BYTE cmd, const void *buff, uint64_t start_ns);
+
+/*
+ * Re-issue a trace against the open image, sleeping to keep its timing
+ * if timed. Writes store filler data and trims drop sectors, so a trace
+ * holding either is refused unless destructive is set.
+ */
+int trace_replay(const char *path, int timed, int destructive);
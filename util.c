@@ -1,5 +1,10 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "elmchan_impl.h"
 #include "elmchan/src/diskio.h"
@@ -7,11 +12,22 @@
 
 #include "util.h"
 
-int write_file(FIL *image_fp, FILE *host_file)
+static int is_zero(const char *buffer, uint32_t len)
+{
+	return buffer[0] == 0 && memcmp(buffer, buffer + 1, len - 1) == 0;
+}
+
+/*
+ * Copy an open image file to a host file. In sparse mode blocks of zeros
+ * are skipped with a seek so the host file system leaves holes there, and
+ * the length is fixed up at the end in case the file ends in a hole.
+ */
+int write_file(FIL *image_fp, FILE *host_file, int sparse)
 {
 	char buffer[4096];
 	int exit_code = 0;
 	int res;
+	int hole = 0;
 
 	uint32_t bytes_read, bytes_wrote;
 
@@ -21,6 +37,17 @@ int write_file(FIL *image_fp, FILE *host_file)
 			break;
 		}
 
+		if (sparse && is_zero(buffer, bytes_read)) {
+			if (fseeko(host_file, bytes_read, SEEK_CUR) != 0) {
+				printf("Error: could not seek past a hole: %s\n", strerror(errno));
+				exit_code = -1;
+				break;
+			}
+			hole = 1;
+			continue;
+		}
+		hole = 0;
+
 		bytes_wrote = fwrite(buffer, 1, bytes_read, host_file);
 		if (bytes_wrote < bytes_read) {
 			printf("Error: could only write %d bytes instead of %d\n", bytes_wrote, bytes_read);
@@ -29,5 +56,87 @@ int write_file(FIL *image_fp, FILE *host_file)
 		}
 	}
 
+	if (exit_code == 0 && hole) {
+		if (fflush(host_file) != 0 || ftruncate(fileno(host_file), ftello(host_file)) != 0) {
+			printf("Error: could not set the length of the extracted file: %s\n", strerror(errno));
+			exit_code = -1;
+		}
+	}
+
 	return exit_code;
 }
+
+/* Parse a byte count with an optional binary K, M, G or T suffix ("64M", "2GiB") */
+int parse_size(const char *str, uint64_t *bytes)
+{
+	static const char units[] = "KMGT";
+	unsigned long long value;
+	char *end;
+	int shift = 0;
+
+	if (!isdigit((unsigned char)str[0])) {
+		return -1;
+	}
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (errno != 0) {
+		return -1;
+	}
+
+	if (*end) {
+		const char *unit = strchr(units, toupper((unsigned char)*end));
+		if (!unit) {
+			return -1;
+		}
+		shift = 10 * (int)(unit - units + 1);
+		end++;
+		if (strcmp(end, "iB") != 0 && strcmp(end, "B") != 0 && *end) {
+			return -1;
+		}
+	}
+	if (value > (UINT64_MAX >> shift)) {
+		return -1;
+	}
+
+	*bytes = (uint64_t)value << shift;
+	return 0;
+}
+
+/*
+ * Make a new image file of the given size. It is only extended with
+ * ftruncate, so it starts out as one big hole and stays sparse through
+ * mkfs. An existing file is never touched, mkfs reformats images.
+ */
+int create_image(const char *path, const char *size_str, unsigned sector_size)
+{
+	uint64_t size;
+	int fd;
+
+	if (parse_size(size_str, &size) != 0 || size == 0) {
+		printf("Invalid image size '%s'\n", size_str);
+		return -1;
+	}
+	if (size % sector_size != 0) {
+		printf("Image size %llu is not a multiple of %u bytes\n", (unsigned long long)size, sector_size);
+		return -1;
+	}
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		printf("'%s' already exists, use mkfs to reformat it\n", path);
+		return -1;
+	}
+	if (fd < 0) {
+		printf("Error: couldn't create '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)size) != 0) {
+		printf("Error: couldn't size '%s' to %llu bytes: %s\n", path, (unsigned long long)size, strerror(errno));
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	close(fd);
+
+	printf("Created %llu byte image '%s'\n", (unsigned long long)size, path);
+	return 0;
+}
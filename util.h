@@ -1,6 +1,9 @@
 #pragma once
 
+#include <stdint.h>
 #include <stdio.h>
 #include "elmchan/src/ff.h"
 
-int write_file(FIL *image_fp, FILE *host_file);
+int write_file(FIL *image_fp, FILE *host_file, int sparse);
+int parse_size(const char *str, uint64_t *bytes);
+int create_image(const char *path, const char *size_str, unsigned sector_size);